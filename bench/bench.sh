@@ -0,0 +1,56 @@
+#!/bin/sh
+
+# Runs neo's benchmark scenarios. Usage: bench.sh [PATH_TO_NEO]
+#
+# Every scenario uses --headless, so the virtual clock and the fixed RNG seed
+# make the simulation identical from run to run and only the timings vary.
+# Set BENCH_FRAMES to change the number of frames per run and BENCH_SEED to
+# run every scenario with a different --seed.
+
+NEO=${1:-./src/neo}
+FRAMES=${BENCH_FRAMES:-2000}
+
+if [ ! -x "$NEO" ]; then
+    echo "bench.sh: cannot execute $NEO" >&2
+    exit 1
+fi
+
+printf "%-12s %-9s %12s %12s %12s %12s %12s\n" \
+    "scenario" "size" "median_ns" "p99_ns" "cells/frame" "bytes/frame" "reset_ns"
+
+# run NAME SIZE [OPTIONS...]
+run() {
+    name=$1
+    size=$2
+    shift 2
+    # Capture the output first, so that a failed run stops the benchmark
+    out=$("$NEO" --headless --size="$size" --frames="$FRAMES" ${BENCH_SEED:+--seed="$BENCH_SEED"} "$@") || {
+        echo "bench.sh: $name $size failed" >&2
+        exit 1
+    }
+    printf '%s\n' "$out" | awk -F: -v name="$name" -v size="$size" '
+        { gsub(/^[ \t]+/, "", $2); stat[$1] = $2 }
+        END {
+            printf "%-12s %-9s %12s %12s %12s %12s %12s\n", name, size,
+                stat["median ns/frame"], stat["p99 ns/frame"],
+                stat["cells/frame"], stat["bytes/frame"], stat["reset ns"]
+        }' || exit 1
+}
+
+for size in 80x25 160x50 240x75 400x120 500x150; do
+    run default "$size"
+done
+
+run async      400x120 --async
+run density5   400x120 -d 5
+run shading1   400x120 --shadingmode=1
+# Taller than the shade table, so long droplets fall back to CalcShade()
+run shadetall  100x2000 --shadingmode=1 -S 60 -d 5
+run shademax   1x65535 --shadingmode=1
+run glitch100  400x120 --glitchpct=100
+run glitchgrp  400x120 --glitchpct=100 --glitchgroups=16
+run glitch1    400x120 --glitchpct=100 --glitchgroups=1
+run fullwidth  400x120 --fullwidth
+run message    400x120 --message="There is no spoon. Only the rain is real."
+run wall       1200x400 -d 5
+run wall-t4    1200x400 -d 5 --threads=4
@@ -0,0 +1,300 @@
+/*
+    ptybench.cpp - Measures what neo writes to a pseudo-terminal
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Runs neo on a pseudo-terminal of a fixed size and reads everything it
+// writes, as fast as possible, like a terminal emulator that never falls
+// behind. Usage: ptybench [-n FRAMES] [-s WxH] [-t TERM] NEO [OPTIONS...]
+//
+// neo is run twice with -p --virtualclock: once for a single frame and once
+// for FRAMES frames. Every frame of both runs simulates exactly one frame
+// period (1/--fps), so both runs start out drawing the same frames. Subtracting
+// the short run from the long one cancels out the cost of starting up and
+// shutting down. The results are printed as "name: value" lines:
+//
+//   bytes/frame       bytes read from the terminal
+//   writes/frame      write() system calls made by neo (from /proc/PID/io)
+//   ns/frame          wall clock time, including waiting on the terminal
+//   median ns/frame   50th percentile of neo's own frame times (--profile)
+//   p99 ns/frame      99th percentile of neo's own frame times
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+#if defined(HAVE_PTY_H)
+#include <pty.h>
+#elif defined(HAVE_UTIL_H)
+#include <util.h>
+#elif defined(HAVE_LIBUTIL_H)
+#include <libutil.h>
+#endif
+#include <cerrno>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+struct RunStats {
+    uint64_t bytes = 0; // Read from the master side
+    uint64_t writes = 0; // write() calls by neo, if hasWrites
+    bool hasWrites = false;
+    uint64_t wallNs = 0; // From fork() until neo exited
+};
+
+struct FrameStats {
+    uint64_t count = 0;
+    uint64_t p50Ns = 0;
+    uint64_t p99Ns = 0;
+};
+
+[[noreturn]] static void Die(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "ptybench: ");
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    exit(1);
+}
+
+static void PrintHelp(bool bErr) {
+    FILE* f = bErr ? stderr : stdout;
+    fprintf(f, "Usage: ptybench [-n FRAMES] [-s WxH] [-t TERM] NEO [OPTIONS...]\n");
+    fprintf(f, "Runs NEO with OPTIONS on a pseudo-terminal and prints what it costs per frame\n");
+    fprintf(f, "\n");
+    fprintf(f, "  -h         show this help message\n");
+    fprintf(f, "  -n FRAMES  number of frames to measure (default 600)\n");
+    fprintf(f, "  -s WxH     terminal size (default 80x25)\n");
+    fprintf(f, "  -t TERM    value of TERM for neo (default xterm-256color)\n");
+    exit(bErr ? 1 : 0);
+}
+
+// Returns the number after "key" in /proc/PID/io
+static bool ReadProcIo(pid_t pid, const char* key, uint64_t* pVal) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/io", static_cast<int>(pid));
+    FILE* fp = fopen(path, "r");
+    if (!fp)
+        return false;
+    char line[128];
+    const size_t keyLen = strlen(key);
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        if (strncmp(line, key, keyLen) == 0) {
+            *pVal = strtoull(line + keyLen, nullptr, 10);
+            found = true;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+static void RunNeo(const vector<string>& args, uint16_t lines, uint16_t cols, const char* term,
+                   RunStats* pStats) {
+    struct winsize ws;
+    memset(&ws, 0, sizeof(ws));
+    ws.ws_row = lines;
+    ws.ws_col = cols;
+    int masterFd;
+    int slaveFd;
+    if (openpty(&masterFd, &slaveFd, nullptr, nullptr, &ws) != 0)
+        Die("openpty() failed: %s\n", strerror(errno));
+
+    vector<char*> argv;
+    for (const string& arg : args)
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    argv.push_back(nullptr);
+
+    const steady_clock::time_point startTime = steady_clock::now();
+    const pid_t pid = fork();
+    if (pid < 0)
+        Die("fork() failed: %s\n", strerror(errno));
+    if (pid == 0) {
+        // Make the pty neo's controlling terminal, so that it gets SIGWINCH
+        // and behaves as it would in a terminal emulator
+        close(masterFd);
+        setsid();
+        ioctl(slaveFd, TIOCSCTTY, 0);
+        dup2(slaveFd, STDIN_FILENO);
+        dup2(slaveFd, STDOUT_FILENO);
+        dup2(slaveFd, STDERR_FILENO);
+        if (slaveFd > STDERR_FILENO)
+            close(slaveFd);
+        setenv("TERM", term, 1);
+        execvp(argv[0], argv.data());
+        _exit(127);
+    }
+    close(slaveFd);
+
+    // Reading fails with EIO once neo has exited and closed the pty
+    char buf[65536];
+    pStats->bytes = 0;
+    for (;;) {
+        const ssize_t len = read(masterFd, buf, sizeof(buf));
+        if (len > 0)
+            pStats->bytes += static_cast<uint64_t>(len);
+        else if (len < 0 && errno == EINTR)
+            continue;
+        else
+            break;
+    }
+    close(masterFd);
+
+    // Wait without reaping neo, so that its /proc entry can still be read
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    while (waitid(P_PID, static_cast<id_t>(pid), &info, WEXITED | WNOWAIT) != 0) {
+        if (errno != EINTR)
+            Die("waitid() failed: %s\n", strerror(errno));
+    }
+    pStats->wallNs = duration_cast<nanoseconds>(steady_clock::now() - startTime).count();
+    pStats->hasWrites = ReadProcIo(pid, "syscw:", &pStats->writes);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR)
+            Die("waitpid() failed: %s\n", strerror(errno));
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        Die("%s did not exit cleanly (status %d)\n", args[0].c_str(), status);
+}
+
+// Reads the whole-frame stats from neo's --profilejson output
+static bool ReadFrameStats(const char* path, FrameStats* pStats) {
+    FILE* fp = fopen(path, "r");
+    if (!fp)
+        return false;
+    char line[256];
+    bool found = false;
+    while (!found && fgets(line, sizeof(line), fp)) {
+        const char* pFrame = strstr(line, "\"frame\": {");
+        if (!pFrame)
+            continue;
+        unsigned long long count;
+        double mean;
+        unsigned long long p50;
+        unsigned long long p90;
+        unsigned long long p99;
+        if (sscanf(pFrame, "\"frame\": {\"count\": %llu, \"mean_ns\": %lf, \"p50_ns\": %llu, "
+                   "\"p90_ns\": %llu, \"p99_ns\": %llu", &count, &mean, &p50, &p90, &p99) == 5) {
+            pStats->count = count;
+            pStats->p50Ns = p50;
+            pStats->p99Ns = p99;
+            found = true;
+        }
+    }
+    fclose(fp);
+    return found;
+}
+
+int main(int argc, char* argv[]) {
+    uint64_t frames = 600;
+    uint16_t lines = 25;
+    uint16_t cols = 80;
+    const char* term = "xterm-256color";
+
+    // '+' stops at NEO, so that its options are left alone
+    int opt;
+    while ((opt = getopt(argc, argv, "+hn:s:t:")) != -1) {
+        switch (opt) {
+            case 'h':
+                PrintHelp(false);
+                break;
+            case 'n': {
+                const long long val = strtoll(optarg, nullptr, 10);
+                if (val < 2)
+                    Die("-n must be at least 2\n");
+                frames = static_cast<uint64_t>(val);
+                break;
+            }
+            case 's': {
+                char* nextStr;
+                const long int width = strtol(optarg, &nextStr, 10);
+                if (!nextStr || (*nextStr != 'x' && *nextStr != 'X'))
+                    Die("Invalid -s option (expected WxH)\n");
+                const long int height = strtol(nextStr + 1, nullptr, 10);
+                if (width < 1 || height < 3 || width > 0xFFFF || height > 0xFFFF)
+                    Die("-s must be at least 1x3 and at most 65535x65535\n");
+                cols = static_cast<uint16_t>(width);
+                lines = static_cast<uint16_t>(height);
+                break;
+            }
+            case 't':
+                term = optarg;
+                break;
+            default:
+                PrintHelp(true);
+                break;
+        }
+    }
+    if (optind >= argc)
+        PrintHelp(true);
+
+    char jsonPath[] = "/tmp/ptybench.XXXXXX";
+    const int jsonFd = mkstemp(jsonPath);
+    if (jsonFd < 0)
+        Die("mkstemp() failed: %s\n", strerror(errno));
+    close(jsonFd);
+
+    // The options given last win, so the user's can not undo these
+    vector<string> args(argv + optind, argv + argc);
+    args.push_back("--profilejson=" + string(jsonPath));
+    args.push_back("--virtualclock");
+
+    RunStats shortRun;
+    args.push_back("--frames=1");
+    RunNeo(args, lines, cols, term, &shortRun);
+    args.back() = "--frames=" + to_string(frames);
+    RunStats longRun;
+    RunNeo(args, lines, cols, term, &longRun);
+
+    FrameStats frameStats;
+    const bool hasFrameStats = ReadFrameStats(jsonPath, &frameStats);
+    unlink(jsonPath);
+    if (!hasFrameStats)
+        Die("could not read the frame times from --profilejson\n");
+    if (frameStats.count != frames)
+        Die("neo only drew %llu of %llu frames\n", static_cast<unsigned long long>(frameStats.count),
+            static_cast<unsigned long long>(frames));
+
+    const double extraFrames = static_cast<double>(frames - 1);
+    printf("frames:          %llu\n", static_cast<unsigned long long>(frames));
+    printf("bytes/frame:     %.1f\n",
+           (static_cast<double>(longRun.bytes) - static_cast<double>(shortRun.bytes)) / extraFrames);
+    if (longRun.hasWrites && shortRun.hasWrites)
+        printf("writes/frame:    %.2f\n",
+               (static_cast<double>(longRun.writes) - static_cast<double>(shortRun.writes)) / extraFrames);
+    else
+        printf("writes/frame:    -\n");
+    printf("ns/frame:        %.0f\n",
+           (static_cast<double>(longRun.wallNs) - static_cast<double>(shortRun.wallNs)) / extraFrames);
+    printf("median ns/frame: %llu\n", static_cast<unsigned long long>(frameStats.p50Ns));
+    printf("p99 ns/frame:    %llu\n", static_cast<unsigned long long>(frameStats.p99Ns));
+    return 0;
+}
@@ -0,0 +1,65 @@
+#!/bin/sh
+
+# Runs neo's terminal output scenarios. Usage: ptybench.sh [PATH_TO_NEO] [PATH_TO_PTYBENCH]
+#
+# Every scenario runs neo on a pseudo-terminal of the given size with each
+# backend (see ptybench.cpp), so it measures what a real terminal would have
+# to receive. The virtual clock makes the frames the same from run to run, but
+# the bytes also depend on the locale (UTF-8 or not) and on TERM. Set
+# BENCH_FRAMES to change the number of frames per run and BENCH_SEED to run
+# every scenario with a different --seed.
+
+NEO=${1:-./src/neo}
+PTYBENCH=${2:-./bench/ptybench}
+FRAMES=${BENCH_FRAMES:-600}
+
+for prog in "$NEO" "$PTYBENCH"; do
+    if [ ! -x "$prog" ]; then
+        echo "ptybench.sh: cannot execute $prog" >&2
+        exit 1
+    fi
+done
+
+printf "%-12s %-8s %-9s %12s %12s %12s %12s %12s\n" \
+    "scenario" "backend" "size" "ns/frame" "median_ns" "p99_ns" "bytes/frame" "writes/frame"
+
+# run_on BACKENDS NAME SIZE [OPTIONS...]
+run_on() {
+    backends=$1
+    name=$2
+    size=$3
+    shift 3
+    for backend in $backends; do
+        # Capture the output first, so that a failed run stops the benchmark
+        out=$("$PTYBENCH" -n "$FRAMES" -s "$size" "$NEO" --backend="$backend" \
+            ${BENCH_SEED:+--seed="$BENCH_SEED"} "$@") || {
+            echo "ptybench.sh: $name $backend $size failed" >&2
+            exit 1
+        }
+        printf '%s\n' "$out" | awk -F: -v name="$name" -v backend="$backend" -v size="$size" '
+            { gsub(/^[ \t]+/, "", $2); stat[$1] = $2 }
+            END {
+                printf "%-12s %-8s %-9s %12s %12s %12s %12s %12s\n", name, backend, size,
+                    stat["ns/frame"], stat["median ns/frame"], stat["p99 ns/frame"],
+                    stat["bytes/frame"], stat["writes/frame"]
+            }' || exit 1
+    done
+}
+
+# run NAME SIZE [OPTIONS...]
+run() {
+    run_on "ncurses vt" "$@"
+}
+
+for size in 80x25 160x50 240x75; do
+    run default "$size"
+done
+
+run async      160x50 --async
+run density5   160x50 -d 5
+run shading1   160x50 --shadingmode=1
+run glitch100  160x50 --glitchpct=100
+run fullwidth  160x50 --fullwidth
+run message    160x50 --message="There is no spoon. Only the rain is real."
+# 24-bit color only works with the vt backend
+run_on vt truecolor 160x50 --colormode=24
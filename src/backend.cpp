@@ -0,0 +1,334 @@
+/*
+    backend.cpp - Implements the output backends
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "backend.h"
+#include "trace.h"
+
+#include <poll.h>
+#include <unistd.h>
+#include <algorithm>
+#include <cerrno>
+#include <cwchar>
+
+#ifdef __APPLE__
+    #define _XOPEN_SOURCE_EXTENDED 1
+#endif
+
+#ifdef HAVE_NCURSESW_H
+    #include <ncursesw/ncurses.h>
+#else
+    #include <ncurses.h>
+#endif
+
+bool NcursesBackend::Flush(FrameBuffer* pFb) {
+    TRACE_SCOPE("flush");
+    if (pFb->PaletteChanged())
+        ApplyPalette(pFb->GetPalette());
+    if (pFb->NeedsClear())
+        clear();
+
+    const uint16_t cols = pFb->GetCols();
+    _cellsWritten = 0;
+    for (const uint32_t idx : pFb->GetDirty()) {
+        if (!pFb->IsStale(idx))
+            continue;
+
+        const Cell& cell = pFb->GetCell(idx);
+        const int line = static_cast<int>(idx / cols);
+        const int col = static_cast<int>(idx % cols);
+        if (cell.color == 0 && cell.val == L' ') {
+            mvaddch(line, col, ' ');
+        } else {
+            const wchar_t wstr[2] = { cell.val, L'\0' };
+            const short pair = (_colorMode != ColorMode::MONO) ? static_cast<short>(cell.color) : 0;
+            cchar_t wc = {};
+            setcchar(&wc, wstr, cell.isBold ? A_BOLD : A_NORMAL, pair, nullptr);
+            mvadd_wch(line, col, &wc);
+        }
+        _cellsWritten++;
+    }
+    pFb->Commit();
+
+    return refresh() == OK;
+}
+
+void NcursesBackend::ApplyPalette(const Palette& palette) const {
+    if (_colorMode == ColorMode::MONO)
+        return;
+
+    use_default_colors();
+    for (const auto& colorContent : palette.colors)
+        init_color(colorContent.color, colorContent.r, colorContent.g, colorContent.b);
+    for (size_t pair = 1; pair < palette.pairs.size(); pair++)
+        init_pair(static_cast<short>(pair), palette.pairs[pair].fg, palette.pairs[pair].bg);
+    bkgd(COLOR_PAIR(1));
+}
+
+bool VtBackend::Flush(FrameBuffer* pFb) {
+    TRACE_SCOPE("flush");
+    const uint16_t cols = pFb->GetCols();
+    // clear() keeps the capacity, so _out only grows to fit the largest frame
+    _out.clear();
+    _out += "\x1b[?2026h";
+
+    if (pFb->PaletteChanged())
+        ApplyPalette(pFb->GetPalette());
+    if (pFb->NeedsClear())
+        ClearScreen();
+
+    _sorted.clear();
+    for (const uint32_t idx : pFb->GetDirty()) {
+        if (pFb->IsStale(idx))
+            _sorted.push_back(idx);
+    }
+    // Row-major order lets consecutive cells share cursor moves
+    sort(_sorted.begin(), _sorted.end());
+
+    for (const uint32_t idx : _sorted) {
+        const Cell& cell = pFb->GetCell(idx);
+        const uint16_t line = static_cast<uint16_t>(idx / cols);
+        const uint16_t col = static_cast<uint16_t>(idx % cols);
+        MoveCursor(line, col);
+        SetSgr(cell.color, cell.isBold);
+        AppendUtf8(cell.val);
+
+        const int width = wcwidth(cell.val);
+        _curCol += (width > 1) ? width : 1;
+        if (_curCol >= cols) {
+            // The cursor is in the "pending wrap" state, which varies by terminal
+            _curLine = 0xFFFF;
+            _curCol = 0xFFFF;
+        }
+    }
+    _cellsWritten = _sorted.size();
+    pFb->Commit();
+
+    // ncurses does not know about our output. Stop getch() from refreshing.
+    if (stdscr)
+        untouchwin(stdscr);
+
+    if (_out.size() == sizeof("\x1b[?2026h") - 1) {
+        _bytesWritten = 0;
+        return true; // Nothing changed
+    }
+    _out += "\x1b[?2026l";
+    return WriteOut();
+}
+
+void VtBackend::Close() {
+    _out.clear();
+    _out += "\x1b[0m";
+    if (_paletteRedefined)
+        _out += "\x1b]104\x1b\\"; // Restore the terminal's default colors
+    WriteOut();
+    _sgrValid = false;
+}
+
+void VtBackend::ApplyPalette(const Palette& palette) {
+    _palette = palette;
+    _sgrValid = false;
+    if (_colorMode != ColorMode::TRUECOLOR)
+        return;
+
+    static const char hexDigits[] = "0123456789abcdef";
+    for (const auto& cc : palette.colors) {
+        const short rgb[3] = { cc.r, cc.g, cc.b };
+        _out += "\x1b]4;";
+        AppendNum(static_cast<unsigned>(cc.color));
+        _out += ";rgb:";
+        for (int ii = 0; ii < 3; ii++) {
+            // ncurses color components range from 0 to 1000
+            const unsigned val = (static_cast<unsigned>(rgb[ii]) * 255 + 500) / 1000;
+            _out += hexDigits[(val >> 4) & 0xF];
+            _out += hexDigits[val & 0xF];
+            if (ii < 2)
+                _out += '/';
+        }
+        _out += "\x1b\\";
+        _paletteRedefined = true;
+    }
+}
+
+void VtBackend::ClearScreen() {
+    SetSgr(0, false); // The background color comes from the first color pair
+    _out += "\x1b[H\x1b[2J";
+    _curLine = 0;
+    _curCol = 0;
+}
+
+void VtBackend::MoveCursor(uint16_t line, uint16_t col) {
+    if (line == _curLine && col == _curCol)
+        return;
+
+    if (line == _curLine && _curCol != 0xFFFF) {
+        if (col == _curCol + 1) {
+            _out += "\x1b[C";
+        } else {
+            _out += "\x1b[";
+            AppendNum(col + 1U);
+            _out += 'G';
+        }
+    } else if (col == _curCol && _curLine != 0xFFFF) {
+        _out += "\x1b[";
+        AppendNum(line + 1U);
+        _out += 'd';
+    } else if (_curLine != 0xFFFF && _curCol != 0xFFFF && col + 1 == _curCol) {
+        // Common when a droplet's chars are written top to bottom
+        _out += "\x1b[";
+        AppendNum(line + 1U);
+        _out += "d\b";
+    } else {
+        _out += "\x1b[";
+        AppendNum(line + 1U);
+        _out += ';';
+        AppendNum(col + 1U);
+        _out += 'H';
+    }
+    _curLine = line;
+    _curCol = col;
+}
+
+void VtBackend::SetSgr(uint16_t color, bool isBold) {
+    uint32_t fg = DEFAULT_COLOR;
+    uint32_t bg = DEFAULT_COLOR;
+    if (_colorMode == ColorMode::DIRECT) {
+        if (color && color < _palette.ramp.size())
+            fg = RgbColor(_palette.ramp[color]);
+        if (!_palette.defaultBg)
+            bg = RgbColor(_palette.bg);
+    } else if (_colorMode != ColorMode::MONO) {
+        // Blank cells use the first pair, like ncurses' bkgd()
+        const size_t pairIdx = color ? color : 1;
+        if (pairIdx < _palette.pairs.size()) {
+            fg = IndexedColor(_palette.pairs[pairIdx].fg);
+            bg = IndexedColor(_palette.pairs[pairIdx].bg);
+        }
+    }
+    if (_sgrValid && fg == _sgrFg && bg == _sgrBg && isBold == _sgrBold)
+        return;
+
+    _out += "\x1b[";
+    if (!_sgrValid) {
+        _out += isBold ? "0;1;" : "0;";
+        AppendColor(fg, false);
+        AppendColor(bg, true);
+    } else {
+        if (isBold != _sgrBold)
+            _out += isBold ? "1;" : "22;";
+        if (fg != _sgrFg)
+            AppendColor(fg, false);
+        if (bg != _sgrBg)
+            AppendColor(bg, true);
+    }
+    _out.back() = 'm'; // Replace the trailing ';'
+
+    _sgrValid = true;
+    _sgrFg = fg;
+    _sgrBg = bg;
+    _sgrBold = isBold;
+}
+
+uint32_t VtBackend::IndexedColor(short color) const {
+    return (color < 0) ? DEFAULT_COLOR : static_cast<uint32_t>(color);
+}
+
+uint32_t VtBackend::RgbColor(const Rgb& rgb) const {
+    return RGB_COLOR | (static_cast<uint32_t>(rgb.r) << 16) |
+        (static_cast<uint32_t>(rgb.g) << 8) | rgb.b;
+}
+
+// Append an SGR color parameter followed by a ';'
+void VtBackend::AppendColor(uint32_t color, bool isBg) {
+    if (color == DEFAULT_COLOR) {
+        _out += isBg ? "49;" : "39;";
+        return;
+    }
+    if (color & RGB_COLOR) {
+        _out += isBg ? "48;2;" : "38;2;";
+        AppendNum((color >> 16) & 0xFF);
+        _out += ';';
+        AppendNum((color >> 8) & 0xFF);
+        _out += ';';
+        AppendNum(color & 0xFF);
+    } else if (_colorMode == ColorMode::COLOR16 && color < 16) {
+        unsigned base = isBg ? 40 : 30;
+        if (color >= 8)
+            base += 60; // The bright colors are 90-97 and 100-107
+        AppendNum(base + (color & 0x7));
+    } else {
+        _out += isBg ? "48;5;" : "38;5;";
+        AppendNum(color);
+    }
+    _out += ';';
+}
+
+void VtBackend::AppendNum(unsigned val) {
+    char buf[16];
+    size_t len = 0;
+    do {
+        buf[len++] = static_cast<char>('0' + val % 10);
+        val /= 10;
+    } while (val);
+    while (len)
+        _out += buf[--len];
+}
+
+void VtBackend::AppendUtf8(wchar_t val) {
+    const uint32_t cp = static_cast<uint32_t>(val);
+    if (cp < 0x80) {
+        _out += static_cast<char>(cp);
+    } else if (cp < 0x800) {
+        _out += static_cast<char>(0xC0 | (cp >> 6));
+        _out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else if (cp < 0x10000) {
+        _out += static_cast<char>(0xE0 | (cp >> 12));
+        _out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        _out += static_cast<char>(0x80 | (cp & 0x3F));
+    } else {
+        _out += static_cast<char>(0xF0 | (cp >> 18));
+        _out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+        _out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+        _out += static_cast<char>(0x80 | (cp & 0x3F));
+    }
+}
+
+bool VtBackend::WriteOut() {
+    _bytesWritten = _out.size();
+    if (_fd < 0)
+        return true;
+
+    size_t offset = 0;
+    while (offset < _out.size()) {
+        const ssize_t ret = write(_fd, _out.data() + offset, _out.size() - offset);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                // The terminal is behind. Sleep until it can take more.
+                pollfd pfd = { _fd, POLLOUT, 0 };
+                if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+                    return false;
+                continue;
+            }
+            return false;
+        }
+        offset += static_cast<size_t>(ret);
+    }
+    return true;
+}
@@ -0,0 +1,110 @@
+/*
+    backend.h
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef BACKEND_H
+#define BACKEND_H
+
+#include "framebuffer.h"
+#include "neo.h"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A Backend pushes the changed cells of a FrameBuffer to the terminal
+class Backend {
+public:
+    virtual ~Backend() {}
+
+    // Write out every changed cell. Returns false if the output failed.
+    virtual bool Flush(FrameBuffer* pFb) = 0;
+    // Undo any terminal state changes. Called before ncurses is shut down.
+    virtual void Close() {}
+
+    // Stats for the last Flush()
+    size_t GetCellsWritten() const { return _cellsWritten; }
+    size_t GetBytesWritten() const { return _bytesWritten; } // 0 if unknown
+
+protected:
+    size_t _cellsWritten = 0;
+    size_t _bytesWritten = 0;
+};
+
+class NcursesBackend : public Backend {
+public:
+    explicit NcursesBackend(ColorMode cm) : _colorMode(cm) {}
+
+    bool Flush(FrameBuffer* pFb) override;
+
+private:
+    ColorMode _colorMode;
+
+    void ApplyPalette(const Palette& palette) const;
+};
+
+// Generates ANSI/VT escape sequences directly. Each frame is built in a
+// single buffer and written with one write() call, wrapped in synchronized
+// output mode (DEC mode 2026) so that supporting terminals do not tear.
+// ncurses is still used for input and for setting up the terminal.
+class VtBackend : public Backend {
+public:
+    VtBackend(ColorMode cm, int fd) : _colorMode(cm), _fd(fd) {}
+
+    bool Flush(FrameBuffer* pFb) override;
+    void Close() override;
+
+private:
+    ColorMode _colorMode;
+    int _fd; // Where the escape sequences are written (-1 discards them)
+    string _out = {}; // The escape sequences for the current frame
+    vector<uint32_t> _sorted = {}; // The dirty cells in output order
+    Palette _palette = {};
+    bool _paletteRedefined = false; // true if the terminal's colors were changed
+
+    // Terminal state after the last write. The cursor is invalid (0xFFFF)
+    // when its position is unknown, e.g. after writing the last column.
+    uint16_t _curLine = 0xFFFF;
+    uint16_t _curCol = 0xFFFF;
+    bool _sgrValid = false;
+    uint32_t _sgrFg = 0;
+    uint32_t _sgrBg = 0;
+    bool _sgrBold = false;
+
+    // SGR colors are encoded as DEFAULT_COLOR, a color number, or an RGB
+    // value tagged with RGB_COLOR
+    static constexpr uint32_t DEFAULT_COLOR = 0xFFFFFFFF;
+    static constexpr uint32_t RGB_COLOR = 0x1000000;
+
+    void ApplyPalette(const Palette& palette);
+    void ClearScreen();
+    void MoveCursor(uint16_t line, uint16_t col);
+    void SetSgr(uint16_t color, bool isBold);
+    uint32_t IndexedColor(short color) const;
+    uint32_t RgbColor(const Rgb& rgb) const;
+    void AppendColor(uint32_t color, bool isBg);
+    void AppendNum(unsigned val);
+    void AppendUtf8(wchar_t val);
+    bool WriteOut();
+};
+
+#endif
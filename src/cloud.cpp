@@ -19,8 +19,11 @@
 
 #include "cloud.h"
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstring>
+#include <limits>
 
 Charset operator&(Charset lhs, Charset rhs) {
     return static_cast<Charset>(
@@ -32,13 +35,22 @@ bool operator!(Charset input) {
     return static_cast<unsigned>(input) == 0;
 }
 
+static int64_t ToNs(high_resolution_clock::time_point time) {
+    return duration_cast<nanoseconds>(time.time_since_epoch()).count();
+}
+
+static high_resolution_clock::time_point FromNs(int64_t ns) {
+    if (ns == numeric_limits<int64_t>::max())
+        return high_resolution_clock::time_point::max();
+    return high_resolution_clock::time_point(duration_cast<high_resolution_clock::duration>(nanoseconds(ns)));
+}
+
 Cloud::Cloud(ColorMode cm, bool def2ascii) :
-    _lines(static_cast<uint16_t>(LINES)),
-    _cols(COLS),
+    _droplets(this),
     _defaultToAscii(def2ascii),
     _colorMode(cm)
 {
-    assert(stdscr != nullptr);
+    UpdateDrawPath();
     if (cm != ColorMode::MONO)
         SetColor(Color::GREEN);
 }
@@ -46,82 +58,210 @@ Cloud::Cloud(ColorMode cm, bool def2ascii) :
 void Cloud::Rain() {
     if (_pause)
         return;
+    TRACE_SCOPE("rain");
+    TRACE_ONLY(_numGlitchedChars = 0);
 
-    high_resolution_clock::time_point curTime = high_resolution_clock::now();
+    high_resolution_clock::time_point curTime = Now();
     SpawnDroplets(curTime);
-
-    if (_forceDrawEverything)
-        clear();
-
-    const bool timeForGlitch = TimeForGlitch(curTime);
-    for (auto& droplet : _droplets) {
-        if (!droplet.IsAlive())
-            continue;
-        droplet.Advance(curTime);
-        if (timeForGlitch)
-            DoGlitch(droplet);
-        droplet.Draw(curTime, _forceDrawEverything);
-        if (!droplet.IsAlive()) {
-            auto& cs = _colStat[droplet.GetCol()];
-            cs.numDroplets--;
-
-            // If the droplet dies very early, then mark the column as free
-            if (droplet.GetTailPutLine() <= _lines / 4)
-                cs.canSpawn = true;
+    Mark(Profiler::Stage::SPAWN);
+
+    // Glitched chars change when their group glitches or changes phase, so
+    // the Droplets in those groups have to redraw their glitched chars
+    const bool glitchChanged = UpdateGlitchGroups(curTime);
+    _glitchVisits.clear();
+    if (glitchChanged && !_forceDrawEverything)
+        CollectGlitchVisits();
+    Mark(Profiler::Stage::GLITCH);
+    if (_pWorkers) {
+        RainThreaded(curTime, _forceDrawEverything);
+    } else {
+        _droplets.Advance(curTime, _forceDrawEverything, _glitchVisits);
+        Mark(Profiler::Stage::ADVANCE);
+        // Glitching changes chars that other Droplets share, so finish it
+        // before drawing, the same as RainThreaded() has to
+        for (const uint32_t idx : _droplets.GetVisited()) {
+            if (GetGlitchGroup(_droplets.GetCol(idx)).isGlitching)
+                DoGlitch(idx);
+        }
+        Mark(Profiler::Stage::GLITCH);
+        TRACE_SCOPE("draw");
+        for (const uint32_t idx : _droplets.GetVisited()) {
+            if (NeedsDraw(idx))
+                _droplets.Draw(idx, curTime, _forceDrawEverything);
+            CheckDropletDeath(idx);
         }
+        Mark(Profiler::Stage::DRAW);
     }
 
     if (!_message.empty()) {
-        CalcMessage();
-        DrawMessage();
+        UpdateMessage();
+        Mark(Profiler::Stage::MESSAGE);
     }
 
     // Bookkeeping logic for glitching and drawing
-    if (timeForGlitch) {
-        _lastGlitchTime = curTime;
-        _nextGlitchTime = _lastGlitchTime + milliseconds(_randGlitchMs(mt));
+    if (glitchChanged) {
+        ClearGlitchGroups();
+        Mark(Profiler::Stage::GLITCH);
     }
     _forceDrawEverything = false;
+
+    TRACE_COUNTER("live droplets", _droplets.GetNumAlive());
+    TRACE_COUNTER("cells drawn", _frameBuf.GetDirty().size());
+    TRACE_COUNTER("glitched chars", _numGlitchedChars);
+}
+
+// Same as the single-threaded part of Rain(), except that the droplets are
+// advanced and drawn one tile at a time on the worker threads. Glitching
+// changes the shared _charPool, so it stays on this thread in between.
+void Cloud::RainThreaded(high_resolution_clock::time_point curTime, bool visitAll) {
+    _droplets.CollectDue(curTime, visitAll, _glitchVisits);
+    for (auto& tile : _tiles)
+        tile.droplets.clear();
+    for (const uint32_t idx : _droplets.GetVisited())
+        _tiles[_droplets.GetCol(idx) / TILE_COLS].droplets.push_back(idx);
+
+    // Waking the workers costs more than a few droplets are worth
+    WorkerPool* pWorkers = _pWorkers.get();
+    if (_droplets.GetVisited().size() < MIN_THREADED_DROPLETS)
+        pWorkers = nullptr;
+
+    _frameTime = curTime;
+    RunTiles(pWorkers, AdvanceTile);
+    for (auto& tile : _tiles)
+        DropletPool::MergeDeferred(&tile.deferred, &_deferred);
+    _droplets.ApplyDeferred(&_deferred);
+    Mark(Profiler::Stage::ADVANCE);
+
+    for (const uint32_t idx : _droplets.GetVisited()) {
+        if (GetGlitchGroup(_droplets.GetCol(idx)).isGlitching)
+            DoGlitch(idx);
+    }
+    Mark(Profiler::Stage::GLITCH);
+
+    RunTiles(pWorkers, DrawTile);
+    for (auto& tile : _tiles) {
+        _frameBuf.AddDirty(tile.dirty);
+        tile.dirty.clear();
+    }
+    for (const uint32_t idx : _droplets.GetVisited())
+        CheckDropletDeath(idx);
+    Mark(Profiler::Stage::DRAW);
+}
+
+void Cloud::RunTiles(WorkerPool* pWorkers, WorkerPool::TaskFunc func) {
+    if (pWorkers) {
+        pWorkers->Run(_tiles.size(), func, this);
+    } else {
+        for (size_t tileIdx = 0; tileIdx < _tiles.size(); tileIdx++)
+            func(this, tileIdx);
+    }
+}
+
+void Cloud::AdvanceTile(void* pCtx, size_t tileIdx) {
+    TRACE_SCOPE("advance tile");
+    Cloud* pCloud = static_cast<Cloud*>(pCtx);
+    Tile& tile = pCloud->_tiles[tileIdx];
+    for (const uint32_t idx : tile.droplets)
+        pCloud->_droplets.AdvanceDue(idx, pCloud->_frameTime, &tile.deferred);
+}
+
+void Cloud::DrawTile(void* pCtx, size_t tileIdx) {
+    TRACE_SCOPE("draw tile");
+    Cloud* pCloud = static_cast<Cloud*>(pCtx);
+    Tile& tile = pCloud->_tiles[tileIdx];
+    for (const uint32_t idx : tile.droplets) {
+        if (pCloud->NeedsDraw(idx))
+            pCloud->_droplets.Draw(idx, pCloud->_frameTime, pCloud->_forceDrawEverything, &tile.dirty);
+    }
+}
+
+// Update the column bookkeeping once a droplet that died has been drawn
+void Cloud::CheckDropletDeath(size_t dropletIdx) {
+    if (_droplets.IsAlive(dropletIdx))
+        return;
+
+    const uint16_t col = _droplets.GetCol(dropletIdx);
+    auto& cs = _colStat[col];
+    for (uint8_t ii = 0; ii < cs.numDroplets; ii++) {
+        if (cs.droplets[ii] == dropletIdx) {
+            cs.droplets[ii] = cs.droplets[cs.numDroplets - 1];
+            break;
+        }
+    }
+    cs.numDroplets--;
+
+    // If the droplet dies very early, then mark the column as free
+    if (_droplets.GetTailPutLine(dropletIdx) <= _lines / 4)
+        cs.canSpawn = true;
+    UpdateSpawnableCol(col);
+}
+
+void Cloud::SetNumThreads(unsigned numThreads) {
+    if (numThreads > 1)
+        _pWorkers.reset(new WorkerPool(numThreads));
+    else
+        _pWorkers.reset();
+}
+
+void Cloud::SetProfiler(Profiler* pProfiler) {
+    _pProfiler = pProfiler;
+    if (!pProfiler)
+        return;
+    if (_pWorkers)
+        _pWorkers->RunOnEveryThread(AttachProfilerThread, pProfiler);
+    else
+        pProfiler->AttachThread();
+}
+
+void Cloud::AttachProfilerThread(void* pCtx, size_t) {
+    static_cast<Profiler*>(pCtx)->AttachThread();
+}
+
+high_resolution_clock::time_point Cloud::NextEventTime() const {
+    if (_pause)
+        return high_resolution_clock::time_point::max();
+    if (_forceDrawEverything)
+        return Now();
+
+    high_resolution_clock::time_point nextTime = _droplets.NextEventTime();
+
+    // Spawning can only fail for lack of a column or a droplet. Both come back
+    // through a droplet event, so only count the spawn time when it can work.
+    if (!_spawnableCols.empty() && _droplets.HasFreeSlot() && _dropletsPerSec > 0.0f) {
+        const nanoseconds spawnPeriod(static_cast<int64_t>(ceil(1.0e9 / _dropletsPerSec)));
+        nextTime = min(nextTime, _lastSpawnTime + spawnPeriod);
+    }
+
+    if (_glitchy && !_glitchWheel.IsEmpty())
+        nextTime = min(nextTime, FromNs(_glitchWheel.NextDueNs()));
+    return nextTime;
 }
 
 void Cloud::Reset() {
-    _lines = static_cast<uint16_t>(LINES);
-    _cols = static_cast<uint16_t>(COLS);
+    TRACE_SCOPE("reset");
+    if (!_fixedSize) {
+        _lines = static_cast<uint16_t>(LINES);
+        _cols = static_cast<uint16_t>(COLS);
+    }
+
+    _frameBuf.Resize(_lines, _cols);
 
     _numDroplets = round(1.5f * _cols);
-    _droplets.clear();
-    _droplets.resize(_numDroplets);
-    for (auto& droplet : _droplets)
-        droplet.Reset();
+    _droplets.Resize(_numDroplets, Now());
+    _tiles.clear();
+    _tiles.resize((_cols + TILE_COLS - 1) / TILE_COLS);
 
     // Reset all the RNG stuff
-    mt.seed(0x1234567);
-
-    int8_t lowPair, highPair;
-    if (_numColorPairs < 3) {
-        lowPair = 1;
-        highPair = 1;
-    } else if (_numColorPairs == 3) {
-        lowPair = 2;
-        highPair = 2;
-    } else {
-        lowPair = 2;
-        highPair = _numColorPairs - 2;
-    }
-    _randColorPair = uniform_int_distribution<int>(lowPair, highPair);
+    _spawnRng.Seed(_seed, SPAWN_STREAM);
+    _glitchRng.Seed(_seed, GLITCH_STREAM);
+    _colorRng.Seed(_seed, COLOR_STREAM);
 
-    _randChance = uniform_real_distribution<float>(0.0f, 1.0f);
-    _randLine = uniform_int_distribution<uint16_t>(0, _lines - 2);
-    _randCpIdx = uniform_int_distribution<uint16_t>(0, static_cast<uint16_t>(CHAR_POOL_SIZE-1));
-    _randLen = uniform_int_distribution<uint16_t>(1, _lines - 2);
-    _randCol = uniform_int_distribution<uint16_t>(0, _cols - 1);
-    _randGlitchMs = uniform_int_distribution<uint16_t>(_glitchLowMs, _glitchHighMs);
-    _randLingerMs = uniform_int_distribution<uint16_t>(_lingerLowMs, _lingerHighMs); // Cannot be 0
-    _randSpeed = uniform_real_distribution<float>(0.3333333f, 1.0f);
+    SetColorPairRange();
 
     const size_t screenSize = _lines * _cols;
     FillGlitchMap(screenSize);
     FillColorMap(screenSize);
+    BuildShadeLut();
 
     const float dropletSeconds = _lines / _charsPerSec;
     _dropletsPerSec = _cols * _dropletDensity / dropletSeconds;
@@ -132,7 +272,12 @@ void Cloud::Reset() {
         colStat.maxSpeedPct = 1.0f;
         colStat.numDroplets = 0;
         colStat.canSpawn = true;
+        colStat.spawnableIdx = 0xFFFF;
     }
+    _spawnableCols.clear();
+    _spawnableCols.reserve(_cols);
+    for (uint16_t col = 0; col < _cols; col++)
+        UpdateSpawnableCol(col);
     SetAsync(_async);
     SetColumnSpeeds();
     UpdateDropletSpeeds();
@@ -140,9 +285,57 @@ void Cloud::Reset() {
     if (!_message.empty())
         ResetMessage();
 
-    _lastGlitchTime = high_resolution_clock::now();
-    _nextGlitchTime = _lastGlitchTime + milliseconds(_randGlitchMs(mt));
-    _lastSpawnTime = _lastGlitchTime;
+    _lastSpawnTime = Now();
+    ResetGlitchGroups(_lastSpawnTime);
+}
+
+// Unlike Reset(), this keeps the Droplets and attributes of everything that
+// is still onscreen. Only the newly exposed cells get new attributes.
+void Cloud::Resize() {
+    TRACE_SCOPE("resize");
+    const uint16_t oldLines = _lines;
+    const uint16_t oldCols = _cols;
+    if (!_fixedSize) {
+        _lines = static_cast<uint16_t>(LINES);
+        _cols = static_cast<uint16_t>(COLS);
+    }
+
+    // The terminal's contents are unreliable after a resize anyway, so start
+    // from a blank screen. The caller must ForceDrawEverything().
+    _frameBuf.Resize(_lines, _cols);
+    if (_lines == oldLines && _cols == oldCols)
+        return;
+
+    // Take the columns that are going away out of _spawnableCols
+    for (uint16_t col = _cols; col < oldCols; col++) {
+        _colStat[col].canSpawn = false;
+        UpdateSpawnableCol(col);
+    }
+    _colStat.resize(_cols);
+    for (uint16_t col = oldCols; col < _cols; col++) {
+        ColumnStatus& cs = _colStat[col];
+        cs.maxSpeedPct = NewColumnSpeed();
+        cs.numDroplets = 0;
+        cs.canSpawn = true;
+        cs.spawnableIdx = 0xFFFF;
+        UpdateSpawnableCol(col);
+    }
+
+    _numDroplets = round(1.5f * _cols);
+    vector<uint32_t> killed;
+    _droplets.Reshape(_numDroplets, oldLines, _lines, _cols, &killed);
+    for (const uint32_t idx : killed) {
+        if (_droplets.GetCol(idx) < _cols)
+            CheckDropletDeath(idx);
+    }
+    _tiles.resize((_cols + TILE_COLS - 1) / TILE_COLS);
+
+    ResizeCellAttrs(oldLines, oldCols);
+    BuildShadeLut();
+    SetDropletDensity(_dropletDensity);
+    AssignGlitchGroups();
+    if (!_message.empty())
+        ResetMessage();
 }
 
 void Cloud::InitChars() {
@@ -182,111 +375,229 @@ void Cloud::InitChars() {
                 _chars.push_back(wchar);
     }
     _chars.insert(_chars.end(), _userChars.begin(), _userChars.end());
-    _randCharIdx = uniform_int_distribution<size_t>(0, _chars.size()-1);
+    _charRng.Seed(_seed, CHAR_STREAM);
+    const uint32_t numChars = static_cast<uint32_t>(_chars.size());
     for (size_t ii = 0; ii < CHAR_POOL_SIZE; ii++)
-        _charPool[ii] = _chars[_randCharIdx(mt)];
+        _charPool[ii] = _chars[_charRng.Below(numChars)];
     for (size_t ii = 0; ii < GLITCH_POOL_SIZE; ii++)
-        _glitchPool[ii] = _chars[_randCharIdx(mt)];
+        _glitchPool[ii] = _chars[_charRng.Below(numChars)];
 }
 
-void Cloud::FillDroplet(Droplet* pDroplet, uint16_t col) {
+size_t Cloud::FillDroplet(uint16_t col, high_resolution_clock::time_point curTime) {
     uint16_t endLine = _lines - 1;
-    if (_randChance(mt) <= _dieEarlyPct)
-        endLine = _randLine(mt);
-    uint16_t cpIdx = _randCpIdx(mt);
+    if (_spawnRng.Chance(Rng::ChanceThreshold(_dieEarlyPct)))
+        endLine = static_cast<uint16_t>(_spawnRng.Range(0, _lines - 2));
+    uint16_t cpIdx = static_cast<uint16_t>(_spawnRng.Below(CHAR_POOL_SIZE));
     uint16_t len = _lines;
-    if (_randChance(mt) <= _shortPct)
-        len = _randLen(mt);
+    if (_spawnRng.Chance(Rng::ChanceThreshold(_shortPct)))
+        len = static_cast<uint16_t>(_spawnRng.Range(1, _lines - 2));
     milliseconds ttl = milliseconds(1);
-    if (endLine <= len)
-        ttl = milliseconds(_randLingerMs(mt));
+    if (endLine <= len) // Linger times cannot be 0
+        ttl = milliseconds(_spawnRng.Range(_lingerLowMs, _lingerHighMs));
     const float speed = _colStat[col].maxSpeedPct * _charsPerSec;
-    *pDroplet = Droplet(this, col, endLine, cpIdx, len, speed, ttl);
-}
-
-bool Cloud::TimeForGlitch(high_resolution_clock::time_point time) const {
-    return _glitchy ? (time >= _nextGlitchTime) : false;
+    return _droplets.Spawn(col, endLine, cpIdx, len, speed, ttl, curTime);
 }
 
-void Cloud::DoGlitch(const Droplet& droplet) {
+void Cloud::DoGlitch(size_t dropletIdx) {
     if (!_glitchy)
         return;
     uint16_t startLine = 0;
-    const uint16_t tpLine = droplet.GetTailPutLine();
+    const uint16_t tpLine = _droplets.GetTailPutLine(dropletIdx);
     if (tpLine != 0xFFFF)
         startLine = tpLine + 1;
 
-    const uint16_t hpLine = droplet.GetHeadPutLine();
-    const uint16_t col = droplet.GetCol();
-    const uint16_t cpIdx = droplet.GetCharPoolIdx();
+    const uint16_t hpLine = _droplets.GetHeadPutLine(dropletIdx);
+    const uint16_t col = _droplets.GetCol(dropletIdx);
+    const uint16_t cpIdx = _droplets.GetCharPoolIdx(dropletIdx);
 
-    for (uint16_t line = startLine; line <= hpLine; line++) {
-        if (IsGlitched(line, col)) {
-            const size_t charIdx = (cpIdx + line) % Cloud::CHAR_POOL_SIZE;
-            assert(charIdx < _charPool.size());
-            assert(_glitchPoolIdx < _glitchPool.size());
-            _charPool[charIdx] = _glitchPool[_glitchPoolIdx];
-            _glitchPoolIdx = (_glitchPoolIdx + 1) % GLITCH_POOL_SIZE;
+    if (HasGlitchIndex()) {
+        const uint16_t* pRow;
+        const uint16_t* pEnd;
+        GetGlitchedRows(col, startLine, hpLine, &pRow, &pEnd);
+        for (; pRow != pEnd; pRow++)
+            GlitchChar(cpIdx, *pRow);
+    } else {
+        for (uint16_t line = startLine; line <= hpLine; line++) {
+            if (IsGlitched(line, col))
+                GlitchChar(cpIdx, line);
         }
     }
 }
 
-bool Cloud::IsBright(high_resolution_clock::time_point time) const {
-    if (time < _lastGlitchTime)
+void Cloud::GlitchChar(uint16_t charPoolIdx, uint16_t line) {
+    TRACE_ONLY(_numGlitchedChars++);
+    const size_t charIdx = (charPoolIdx + line) % Cloud::CHAR_POOL_SIZE;
+    assert(charIdx < _charPool.size());
+    assert(_glitchPoolIdx < _glitchPool.size());
+    _charPool[charIdx] = _glitchPool[_glitchPoolIdx];
+    _glitchPoolIdx = (_glitchPoolIdx + 1) % GLITCH_POOL_SIZE;
+}
+
+void Cloud::GetGlitchedRows(uint16_t col, uint16_t firstLine, uint16_t lastLine,
+                            const uint16_t** ppBegin, const uint16_t** ppEnd) const {
+    assert(HasGlitchIndex());
+    if (static_cast<size_t>(col) + 1 >= _glitchRowStart.size()) {
+        *ppBegin = *ppEnd = nullptr; // Glitching is off
+        return;
+    }
+    const uint16_t* pColBegin = _glitchRows.data() + _glitchRowStart[col];
+    const uint16_t* pColEnd = _glitchRows.data() + _glitchRowStart[col + 1];
+    *ppBegin = lower_bound(pColBegin, pColEnd, firstLine);
+    *ppEnd = upper_bound(*ppBegin, pColEnd, lastLine);
+}
+
+// A column's group only depends on the column, so it survives a resize
+void Cloud::AssignGlitchGroups() {
+    _colGlitchGroup.resize(_cols);
+    _glitchGroupColStart.assign(_numGlitchGroups + 1, 0);
+    for (uint16_t col = 0; col < _cols; col++) {
+        const uint32_t hash = Rng::Hash(col, _seed, GLITCH_GROUP_STREAM);
+        _colGlitchGroup[col] = static_cast<uint8_t>(Rng::HashRange(hash, 0, _numGlitchGroups - 1));
+        _glitchGroupColStart[_colGlitchGroup[col] + 1]++;
+    }
+    for (size_t groupIdx = 0; groupIdx < _numGlitchGroups; groupIdx++)
+        _glitchGroupColStart[groupIdx + 1] += _glitchGroupColStart[groupIdx];
+
+    // Columns are added in order, so each group's columns stay sorted
+    _glitchGroupCols.resize(_cols);
+    vector<uint32_t> next(_glitchGroupColStart.begin(), _glitchGroupColStart.end() - 1);
+    for (uint16_t col = 0; col < _cols; col++)
+        _glitchGroupCols[next[_colGlitchGroup[col]]++] = col;
+}
+
+void Cloud::ResetGlitchGroups(high_resolution_clock::time_point curTime) {
+    // By default every few columns glitch on their own schedule, so that the
+    // glitched chars do not all flash together. A resize keeps the groups.
+    _numGlitchGroups = _glitchGroupsOpt;
+    if (!_numGlitchGroups) {
+        const int groups = (_cols + COLS_PER_GLITCH_GROUP - 1) / COLS_PER_GLITCH_GROUP;
+        _numGlitchGroups = static_cast<uint16_t>(groups > MAX_GLITCH_GROUPS ? MAX_GLITCH_GROUPS : max(groups, 1));
+    }
+    AssignGlitchGroups();
+    _glitchGroups.assign(_numGlitchGroups, GlitchGroup{});
+    _glitchWheel.Reset(ToNs(curTime));
+    if (!_glitchy)
+        return;
+    for (size_t groupIdx = 0; groupIdx < _glitchGroups.size(); groupIdx++) {
+        GlitchGroup& group = _glitchGroups[groupIdx];
+        const uint32_t intervalMs = _glitchRng.Range(_glitchLowMs, _glitchHighMs);
+        // Start each group at a different point in its cycle
+        uint32_t offsetMs = 0;
+        if (_numGlitchGroups > 1)
+            offsetMs = _glitchRng.Below(intervalMs);
+        group.lastTime = curTime - milliseconds(offsetMs);
+        group.nextTime = group.lastTime + milliseconds(intervalMs);
+        group.phase = 0xFF;
+        _glitchWheel.Schedule(static_cast<uint32_t>(groupIdx), 0, ToNs(curTime));
+    }
+}
+
+bool Cloud::UpdateGlitchGroups(high_resolution_clock::time_point curTime) {
+    TRACE_SCOPE("glitch groups");
+    _dueGlitches.clear();
+    if (!_glitchy)
         return false;
-    uint64_t timeSinceGlitch = duration_cast<nanoseconds>(time - _lastGlitchTime).count();
-    uint64_t timeBetweenGlitches = duration_cast<nanoseconds>(_nextGlitchTime - _lastGlitchTime).count();
-    return static_cast<double>(timeSinceGlitch) / timeBetweenGlitches <= 0.25;
-}
-
-bool Cloud::IsDim(high_resolution_clock::time_point time) const {
-    if (time > _nextGlitchTime)
-        return true;
-    uint64_t timeSinceGlitch = duration_cast<nanoseconds>(time - _lastGlitchTime).count();
-    uint64_t timeBetweenGlitches = duration_cast<nanoseconds>(_nextGlitchTime - _lastGlitchTime).count();
-    return static_cast<double>(timeSinceGlitch) / timeBetweenGlitches >= 0.75;
-}
-
-void Cloud::GetAttr(uint16_t line, uint16_t col, wchar_t val, Droplet::CharLoc ct,
-                    CharAttr* pAttr, high_resolution_clock::time_point time,
-                    uint16_t headPutLine, uint16_t length) const {
-    if (_boldMode == BoldMode::RANDOM)
-        pAttr->isBold = ((line ^ val) % 2 == 1);
-    const size_t idx = col * _lines + line;
-    pAttr->colorPair = _colorPairMap.at(idx);
-    if (_shadingMode == ShadingMode::DISTANCE_FROM_HEAD) {
-        pAttr->colorPair = _numColorPairs -
-            round(static_cast<float>(headPutLine - line) / length *
-                  static_cast<float>(_numColorPairs - 1));
-    }
-    if (_glitchy && _glitchMap.at(idx)) {
-        if (IsBright(time)) {
-            pAttr->colorPair++;
-            pAttr->isBold = true;
-        } else if (IsDim(time)) {
-            pAttr->colorPair--;
-            pAttr->isBold = false;
-        }
-    }
-    switch (ct) {
-        case Droplet::CharLoc::TAIL:
-            pAttr->colorPair = 1;
-            pAttr->isBold = false;
-            break;
-        case Droplet::CharLoc::HEAD:
-            pAttr->colorPair = _numColorPairs;
-            pAttr->isBold = true;
-            break;
-        case Droplet::CharLoc::MIDDLE: // fallthrough
-        default:
-            pAttr->colorPair = min(pAttr->colorPair, _numColorPairs - 1);
-            pAttr->colorPair = max(pAttr->colorPair, 1);
-            break;
+
+    bool anyChanged = false;
+    _glitchWheel.PopDue(ToNs(curTime), &_dueGlitches);
+    for (const auto& event : _dueGlitches) {
+        GlitchGroup& group = _glitchGroups[event.id];
+        if (curTime >= group.nextTime) {
+            group.isGlitching = true;
+            group.lastTime = curTime;
+            group.nextTime = curTime + milliseconds(_glitchRng.Range(_glitchLowMs, _glitchHighMs));
+        }
+        const uint8_t phase = CalcGlitchPhase(group, curTime);
+        group.isChanged = group.isGlitching || phase != group.phase;
+        group.phase = phase;
+        anyChanged = anyChanged || group.isChanged;
+        ScheduleGlitchGroup(event.id);
+    }
+    return anyChanged;
+}
+
+void Cloud::ClearGlitchGroups() {
+    for (const auto& event : _dueGlitches) {
+        _glitchGroups[event.id].isGlitching = false;
+        _glitchGroups[event.id].isChanged = false;
+    }
+}
+
+void Cloud::CollectGlitchVisits() {
+    for (const auto& event : _dueGlitches) {
+        if (!_glitchGroups[event.id].isChanged)
+            continue;
+        const uint32_t colEnd = _glitchGroupColStart[event.id + 1];
+        for (uint32_t ii = _glitchGroupColStart[event.id]; ii < colEnd; ii++) {
+            const ColumnStatus& cs = _colStat[_glitchGroupCols[ii]];
+            _glitchVisits.insert(_glitchVisits.end(), cs.droplets, cs.droplets + cs.numDroplets);
+        }
     }
-    if (_boldMode == BoldMode::OFF)
-        pAttr->isBold = false;
-    else if (_boldMode == BoldMode::ALL)
-        pAttr->isBold = true;
+}
+
+// The next event is the glitch itself or a little after the 25% and 75%
+// points where CalcGlitchPhase() changes
+void Cloud::ScheduleGlitchGroup(size_t groupIdx) {
+    const GlitchGroup& group = _glitchGroups[groupIdx];
+    const nanoseconds interval = duration_cast<nanoseconds>(group.nextTime - group.lastTime);
+    const nanoseconds margin = microseconds(1);
+    high_resolution_clock::time_point dueTime = group.nextTime;
+    if (group.phase == 0)
+        dueTime = group.lastTime + interval / 4 + margin;
+    else if (group.phase == 1)
+        dueTime = group.lastTime + interval * 3 / 4 + margin;
+    _glitchWheel.Schedule(static_cast<uint32_t>(groupIdx), 0, ToNs(dueTime));
+}
+
+uint8_t Cloud::CalcGlitchPhase(const GlitchGroup& group, high_resolution_clock::time_point time) const {
+    if (time > group.nextTime || time < group.lastTime)
+        return 2;
+    const double timeSinceGlitch = duration_cast<nanoseconds>(time - group.lastTime).count();
+    const double timeBetweenGlitches = duration_cast<nanoseconds>(group.nextTime - group.lastTime).count();
+    const double progress = timeSinceGlitch / timeBetweenGlitches;
+    if (progress <= 0.25)
+        return 0;
+    if (progress >= 0.75)
+        return 2;
+    return 1;
+}
+
+// Droplets that did not move only need drawing if their glitched chars changed
+bool Cloud::NeedsDraw(size_t dropletIdx) const {
+    return _forceDrawEverything || _droplets.HasMoved(dropletIdx) ||
+        GetGlitchGroup(_droplets.GetCol(dropletIdx)).isChanged;
+}
+
+void Cloud::SetShadingMode(ShadingMode sm) {
+    _shadingMode = sm;
+    BuildShadeLut();
+    UpdateDrawPath();
+    ForceDrawEverything();
+}
+
+void Cloud::BuildShadeLut() {
+    if (_shadingMode != ShadingMode::DISTANCE_FROM_HEAD)
+        return;
+    _shadeLutLength = _lines < MAX_SHADE_LUT_LENGTH ? _lines : MAX_SHADE_LUT_LENGTH;
+    _shadeLut.resize(static_cast<size_t>(_shadeLutLength + 1) * (_shadeLutLength + 2) / 2);
+    size_t lutIdx = 0;
+    for (uint16_t length = 0; length <= _shadeLutLength; length++) {
+        for (int distance = 0; distance <= length; distance++)
+            _shadeLut[lutIdx++] = static_cast<int16_t>(length ? CalcShade(length, distance) : 0);
+    }
+}
+
+void Cloud::SetScreenSize(uint16_t lines, uint16_t cols) {
+    _lines = lines;
+    _cols = cols;
+    _fixedSize = true;
+}
+
+void Cloud::UseVirtualClock() {
+    // Any fixed, non-zero starting point works. Droplets treat a zero
+    // time_point as "unset".
+    _virtualTime = high_resolution_clock::time_point(hours(1));
+    _useVirtualClock = true;
 }
 
 void Cloud::SetCharsPerSec(float cps) {
@@ -299,6 +610,17 @@ void Cloud::SetCharsPerSec(float cps) {
     UpdateDropletSpeeds();
 }
 
+int Cloud::GetColorPair(uint16_t line, uint16_t col) const {
+    if (_hashAttrs) {
+        const uint64_t stream = COLOR_STREAM | (static_cast<uint64_t>(_colorEpoch) << 8);
+        const uint32_t hash = Rng::Hash(CellKey(line, col), _seed, stream);
+        return static_cast<int>(Rng::HashRange(hash, _colorPairLow, _colorPairHigh));
+    }
+    const size_t cellIdx = CellIdx(line, col);
+    assert(cellIdx < _cellAttrs.size());
+    return _cellAttrs[cellIdx] & CELL_COLOR_MASK;
+}
+
 wchar_t Cloud::GetChar(uint16_t line, uint16_t charPoolIdx) const {
     const size_t charIdx = (charPoolIdx + line) % Cloud::CHAR_POOL_SIZE;
     assert(charIdx < _charPool.size());
@@ -308,29 +630,35 @@ wchar_t Cloud::GetChar(uint16_t line, uint16_t charPoolIdx) const {
 bool Cloud::IsGlitched(uint16_t line, uint16_t col) const {
     if (!_glitchy)
         return false;
-    const size_t mapIdx = col * _lines + line;
-    assert(mapIdx < _glitchMap.size());
-    return _glitchMap[mapIdx];
+    if (_hashAttrs)
+        return Rng::Hash(CellKey(line, col), _seed, GLITCH_STREAM) < _glitchThreshold;
+    const size_t cellIdx = CellIdx(line, col);
+    assert(cellIdx < _cellAttrs.size());
+    return (_cellAttrs[cellIdx] & CELL_GLITCHED) != 0;
 }
 
 void Cloud::TogglePause() {
     _pause = !_pause;
     if (_pause) {
-        _pauseTime = high_resolution_clock::now();
+        _pauseTime = Now();
     } else {
-        auto elapsed = duration_cast<milliseconds>(high_resolution_clock::now() - _pauseTime);
+        auto elapsed = duration_cast<milliseconds>(Now() - _pauseTime);
         _lastSpawnTime += elapsed;
-        for (auto& droplet : _droplets) {
-            if (!droplet.IsAlive())
-                continue;
-            droplet.IncrementTime(elapsed);
+        _droplets.IncrementTime(elapsed);
+        if (_glitchy) {
+            _glitchWheel.Reset(ToNs(Now()));
+            for (size_t groupIdx = 0; groupIdx < _glitchGroups.size(); groupIdx++) {
+                _glitchGroups[groupIdx].lastTime += elapsed;
+                _glitchGroups[groupIdx].nextTime += elapsed;
+                ScheduleGlitchGroup(groupIdx);
+            }
         }
     }
 }
 
 void Cloud::SetColor(Color c) {
     _color = c;
-    use_default_colors();
+    _palette = {};
     int bgColor = 16;
     if (_colorMode == ColorMode::COLOR16)
         bgColor = 0;
@@ -338,217 +666,217 @@ void Cloud::SetColor(Color c) {
         bgColor = -1;
     switch (_color) {
         case Color::USER: {
-            if (_colorMode == ColorMode::TRUECOLOR) {
+            if (UsesRgb()) {
                 for (const auto& colorContent : _usrColors) {
                     if (colorContent.r == 0x7FFF || colorContent.g == 0x7FFF || colorContent.b == 0x7FFF)
                         continue;
-                    init_color(colorContent.color, colorContent.r, colorContent.g, colorContent.b);
+                    InitColor(colorContent.color, colorContent.r, colorContent.g, colorContent.b);
                 }
             }
             bgColor = _usrColors[0].color;
             for (_numColorPairs = 1; static_cast<size_t>(_numColorPairs) < _usrColors.size(); _numColorPairs++)
-                init_pair(_numColorPairs, _usrColors[_numColorPairs].color, bgColor);
+                InitPair(_numColorPairs, _usrColors[_numColorPairs].color, bgColor);
             _numColorPairs--;
             break;
         }
         case Color::GREEN: {
-            if (_colorMode == ColorMode::TRUECOLOR) {
-                init_color(234, 71, 141, 83);
-                init_color(22, 149, 243, 161);
-                init_color(28, 188, 596, 318);
-                init_color(35, 188, 714, 397);
-                init_color(78, 227, 925, 561);
-                init_color(84, 271, 973, 667);
-                init_color(159, 667, 1000, 941);
+            if (UsesRgb()) {
+                InitColor(234, 71, 141, 83);
+                InitColor(22, 149, 243, 161);
+                InitColor(28, 188, 596, 318);
+                InitColor(35, 188, 714, 397);
+                InitColor(78, 227, 925, 561);
+                InitColor(84, 271, 973, 667);
+                InitColor(159, 667, 1000, 941);
             }
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 2;
-                init_pair(1, 10, bgColor);
-                init_pair(2, 15, bgColor);
+                InitPair(1, 10, bgColor);
+                InitPair(2, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 234, bgColor); // normal-4
-                init_pair(2, 22, bgColor);  // normal-3
-                init_pair(3, 28, bgColor);  // normal-2
-                init_pair(4, 35, bgColor);  // normal-1
-                init_pair(5, 78, bgColor);  // normal green
-                init_pair(6, 84, bgColor);  // bright green
-                init_pair(7, 159, bgColor); // leading edge
+                InitPair(1, 234, bgColor); // normal-4
+                InitPair(2, 22, bgColor);  // normal-3
+                InitPair(3, 28, bgColor);  // normal-2
+                InitPair(4, 35, bgColor);  // normal-1
+                InitPair(5, 78, bgColor);  // normal green
+                InitPair(6, 84, bgColor);  // bright green
+                InitPair(7, 159, bgColor); // leading edge
             }
             break;
         }
         case Color::GOLD: {
-            if (_colorMode == ColorMode::TRUECOLOR) {
-                init_color(58, 839, 545, 216);
-                init_color(94, 905, 694, 447);
-                init_color(172, 945, 831, 635);
-                init_color(178, 1000, 922, 565);
-                init_color(228, 1000, 953, 796);
-                init_color(230, 976, 976, 968);
+            if (UsesRgb()) {
+                InitColor(58, 839, 545, 216);
+                InitColor(94, 905, 694, 447);
+                InitColor(172, 945, 831, 635);
+                InitColor(178, 1000, 922, 565);
+                InitColor(228, 1000, 953, 796);
+                InitColor(230, 976, 976, 968);
             }
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 4;
-                init_pair(1, 8, bgColor);
-                init_pair(2, 3, bgColor);
-                init_pair(3, 11, bgColor);
-                init_pair(4, 15, bgColor);
+                InitPair(1, 8, bgColor);
+                InitPair(2, 3, bgColor);
+                InitPair(3, 11, bgColor);
+                InitPair(4, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 58, bgColor); // rgb=44,23,0
-                init_pair(2, 94, bgColor); // rgb=135,78,26
-                init_pair(3, 172, bgColor); // rgb=214,139,55
-                init_pair(4, 178, bgColor); // rgb=211.137,53
-                init_pair(5, 228, bgColor); // rgb=255,235,144
-                init_pair(6, 230, bgColor); // rgb=255, 243, 203
-                init_pair(7, 231, bgColor); // pure white
+                InitPair(1, 58, bgColor); // rgb=44,23,0
+                InitPair(2, 94, bgColor); // rgb=135,78,26
+                InitPair(3, 172, bgColor); // rgb=214,139,55
+                InitPair(4, 178, bgColor); // rgb=211.137,53
+                InitPair(5, 228, bgColor); // rgb=255,235,144
+                InitPair(6, 230, bgColor); // rgb=255, 243, 203
+                InitPair(7, 231, bgColor); // pure white
             }
             break;
         }
         case Color::GREEN2: {
-            if (_colorMode == ColorMode::TRUECOLOR) {
-                init_color(28, 16, 180, 59);
-                init_color(34, 59, 246, 117);
-                init_color(76, 46, 512, 172);
-                init_color(84, 262, 749, 332);
-                init_color(120, 520, 945, 578);
-                init_color(157, 676, 969, 758);
-                init_color(231, 906, 1000, 898);
+            if (UsesRgb()) {
+                InitColor(28, 16, 180, 59);
+                InitColor(34, 59, 246, 117);
+                InitColor(76, 46, 512, 172);
+                InitColor(84, 262, 749, 332);
+                InitColor(120, 520, 945, 578);
+                InitColor(157, 676, 969, 758);
+                InitColor(231, 906, 1000, 898);
             }
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 4;
-                init_pair(1, 8, bgColor);
-                init_pair(2, 2, bgColor);
-                init_pair(3, 10, bgColor);
-                init_pair(4, 15, bgColor);
+                InitPair(1, 8, bgColor);
+                InitPair(2, 2, bgColor);
+                InitPair(3, 10, bgColor);
+                InitPair(4, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 28, bgColor);
-                init_pair(2, 34, bgColor);
-                init_pair(3, 76, bgColor);
-                init_pair(4, 84, bgColor);
-                init_pair(5, 120, bgColor);
-                init_pair(6, 157, bgColor);
-                init_pair(7, 231, bgColor);
+                InitPair(1, 28, bgColor);
+                InitPair(2, 34, bgColor);
+                InitPair(3, 76, bgColor);
+                InitPair(4, 84, bgColor);
+                InitPair(5, 120, bgColor);
+                InitPair(6, 157, bgColor);
+                InitPair(7, 231, bgColor);
             }
             break;
         }
         case Color::GREEN3: {
-            if (_colorMode == ColorMode::TRUECOLOR) {
-                init_color(22, 0, 373, 0);
-                init_color(28, 0, 529, 0);
-                init_color(34, 0, 686, 0);
-                init_color(70, 373, 686, 0);
-                init_color(76, 373, 843, 0);
-                init_color(82, 373, 1000, 0);
-                init_color(157, 686, 1000, 686);
+            if (UsesRgb()) {
+                InitColor(22, 0, 373, 0);
+                InitColor(28, 0, 529, 0);
+                InitColor(34, 0, 686, 0);
+                InitColor(70, 373, 686, 0);
+                InitColor(76, 373, 843, 0);
+                InitColor(82, 373, 1000, 0);
+                InitColor(157, 686, 1000, 686);
             }
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 2;
-                init_pair(1, 2, bgColor);
-                init_pair(2, 15, bgColor);
+                InitPair(1, 2, bgColor);
+                InitPair(2, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 22, bgColor);
-                init_pair(2, 28, bgColor);
-                init_pair(3, 34, bgColor);
-                init_pair(4, 70, bgColor);
-                init_pair(5, 76, bgColor);
-                init_pair(6, 82, bgColor);
-                init_pair(7, 157, bgColor);
+                InitPair(1, 22, bgColor);
+                InitPair(2, 28, bgColor);
+                InitPair(3, 34, bgColor);
+                InitPair(4, 70, bgColor);
+                InitPair(5, 76, bgColor);
+                InitPair(6, 82, bgColor);
+                InitPair(7, 157, bgColor);
             }
             break;
         }
         case Color::YELLOW: {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 3;
-                init_pair(1, 8, bgColor);
-                init_pair(2, 11, bgColor);
-                init_pair(3, 15, bgColor);
+                InitPair(1, 8, bgColor);
+                InitPair(2, 11, bgColor);
+                InitPair(3, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 100, bgColor);
-                init_pair(2, 142, bgColor);
-                init_pair(3, 184, bgColor);
-                init_pair(4, 226, bgColor);
-                init_pair(5, 227, bgColor);
-                init_pair(6, 229, bgColor);
-                init_pair(7, 230, bgColor);
+                InitPair(1, 100, bgColor);
+                InitPair(2, 142, bgColor);
+                InitPair(3, 184, bgColor);
+                InitPair(4, 226, bgColor);
+                InitPair(5, 227, bgColor);
+                InitPair(6, 229, bgColor);
+                InitPair(7, 230, bgColor);
             }
             break;
         }
         case Color::RAINBOW: {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 6;
-                init_pair(1, 9, bgColor);
-                init_pair(2, 1, bgColor);
-                init_pair(3, 11, bgColor);
-                init_pair(4, 10, bgColor);
-                init_pair(5, 12, bgColor);
-                init_pair(6, 13, bgColor);
+                InitPair(1, 9, bgColor);
+                InitPair(2, 1, bgColor);
+                InitPair(3, 11, bgColor);
+                InitPair(4, 10, bgColor);
+                InitPair(5, 12, bgColor);
+                InitPair(6, 13, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 196, bgColor);
-                init_pair(2, 208, bgColor);
-                init_pair(3, 226, bgColor);
-                init_pair(4, 46, bgColor);
-                init_pair(5, 21, bgColor);
-                init_pair(6, 93, bgColor);
-                init_pair(7, 201, bgColor);
+                InitPair(1, 196, bgColor);
+                InitPair(2, 208, bgColor);
+                InitPair(3, 226, bgColor);
+                InitPair(4, 46, bgColor);
+                InitPair(5, 21, bgColor);
+                InitPair(6, 93, bgColor);
+                InitPair(7, 201, bgColor);
             }
             break;
         }
         case Color::RED: {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 3;
-                init_pair(1, 1, bgColor);
-                init_pair(2, 9, bgColor);
-                init_pair(3, 15, bgColor);
+                InitPair(1, 1, bgColor);
+                InitPair(2, 9, bgColor);
+                InitPair(3, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 234, bgColor);
-                init_pair(2, 52, bgColor);
-                init_pair(3, 88, bgColor);
-                init_pair(4, 124, bgColor);
-                init_pair(5, 160, bgColor);
-                init_pair(6, 196, bgColor);
-                init_pair(7, 217, bgColor);
+                InitPair(1, 234, bgColor);
+                InitPair(2, 52, bgColor);
+                InitPair(3, 88, bgColor);
+                InitPair(4, 124, bgColor);
+                InitPair(5, 160, bgColor);
+                InitPair(6, 196, bgColor);
+                InitPair(7, 217, bgColor);
             }
             break;
         }
         case Color::BLUE: {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 3;
-                init_pair(1, 4, bgColor);
-                init_pair(2, 12, bgColor);
-                init_pair(3, 15, bgColor);
+                InitPair(1, 4, bgColor);
+                InitPair(2, 12, bgColor);
+                InitPair(3, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 234, bgColor);
-                init_pair(2, 17, bgColor);
-                init_pair(3, 18, bgColor);
-                init_pair(4, 19, bgColor);
-                init_pair(4, 20, bgColor);
-                init_pair(5, 21, bgColor);
-                init_pair(6, 75, bgColor);
-                init_pair(7, 159, bgColor);
+                InitPair(1, 234, bgColor);
+                InitPair(2, 17, bgColor);
+                InitPair(3, 18, bgColor);
+                InitPair(4, 19, bgColor);
+                InitPair(4, 20, bgColor);
+                InitPair(5, 21, bgColor);
+                InitPair(6, 75, bgColor);
+                InitPair(7, 159, bgColor);
             }
             break;
         }
         case Color::CYAN: {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 3;
-                init_pair(1, 6, bgColor);
-                init_pair(2, 14, bgColor);
-                init_pair(3, 15, bgColor);
+                InitPair(1, 6, bgColor);
+                InitPair(2, 14, bgColor);
+                InitPair(3, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 24, bgColor);
-                init_pair(2, 25, bgColor);
-                init_pair(3, 31, bgColor);
-                init_pair(4, 32, bgColor);
-                init_pair(5, 38, bgColor);
-                init_pair(6, 45, bgColor);
-                init_pair(7, 159, bgColor);
+                InitPair(1, 24, bgColor);
+                InitPair(2, 25, bgColor);
+                InitPair(3, 31, bgColor);
+                InitPair(4, 32, bgColor);
+                InitPair(5, 38, bgColor);
+                InitPair(6, 45, bgColor);
+                InitPair(7, 159, bgColor);
             }
             break;
         }
@@ -557,17 +885,17 @@ void Cloud::SetColor(Color c) {
             if (_colorMode == ColorMode::COLOR16) {
                 // Orange isn't really achievable in 16 color mode...
                 _numColorPairs = 2;
-                init_pair(1, 1, bgColor);
-                init_pair(2, 7, bgColor);
+                InitPair(1, 1, bgColor);
+                InitPair(2, 7, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 52, bgColor);
-                init_pair(2, 94, bgColor);
-                init_pair(3, 130, bgColor);
-                init_pair(4, 166, bgColor);
-                init_pair(5, 202, bgColor);
-                init_pair(6, 208, bgColor);
-                init_pair(7, 231, bgColor);
+                InitPair(1, 52, bgColor);
+                InitPair(2, 94, bgColor);
+                InitPair(3, 130, bgColor);
+                InitPair(4, 166, bgColor);
+                InitPair(5, 202, bgColor);
+                InitPair(6, 208, bgColor);
+                InitPair(7, 231, bgColor);
             }
             break;
         }
@@ -575,17 +903,17 @@ void Cloud::SetColor(Color c) {
         {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 2;
-                init_pair(1, 5, bgColor);
-                init_pair(2, 7, bgColor);
+                InitPair(1, 5, bgColor);
+                InitPair(2, 7, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 60, bgColor);
-                init_pair(2, 61, bgColor);
-                init_pair(3, 62, bgColor);
-                init_pair(4, 63, bgColor);
-                init_pair(5, 69, bgColor);
-                init_pair(6, 111, bgColor);
-                init_pair(7, 225, bgColor);
+                InitPair(1, 60, bgColor);
+                InitPair(2, 61, bgColor);
+                InitPair(3, 62, bgColor);
+                InitPair(4, 63, bgColor);
+                InitPair(5, 69, bgColor);
+                InitPair(6, 111, bgColor);
+                InitPair(7, 225, bgColor);
             }
             break;
         }
@@ -593,17 +921,17 @@ void Cloud::SetColor(Color c) {
         {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 2;
-                init_pair(1, 13, bgColor);
-                init_pair(2, 15, bgColor);
+                InitPair(1, 13, bgColor);
+                InitPair(2, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 133, bgColor);
-                init_pair(2, 139, bgColor);
-                init_pair(3, 176, bgColor);
-                init_pair(4, 212, bgColor);
-                init_pair(5, 218, bgColor);
-                init_pair(6, 224, bgColor);
-                init_pair(7, 231, bgColor);
+                InitPair(1, 133, bgColor);
+                InitPair(2, 139, bgColor);
+                InitPair(3, 176, bgColor);
+                InitPair(4, 212, bgColor);
+                InitPair(5, 218, bgColor);
+                InitPair(6, 224, bgColor);
+                InitPair(7, 231, bgColor);
             }
             break;
         }
@@ -611,18 +939,18 @@ void Cloud::SetColor(Color c) {
         {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 3;
-                init_pair(1, 5, bgColor);
-                init_pair(2, 13, bgColor);
-                init_pair(3, 15, bgColor);
+                InitPair(1, 5, bgColor);
+                InitPair(2, 13, bgColor);
+                InitPair(3, 15, bgColor);
             } else {
                 _numColorPairs = 7;
-                init_pair(1, 145, bgColor);
-                init_pair(2, 181, bgColor);
-                init_pair(3, 217, bgColor);
-                init_pair(4, 218, bgColor);
-                init_pair(5, 224, bgColor);
-                init_pair(6, 225, bgColor);
-                init_pair(7, 231, bgColor);
+                InitPair(1, 145, bgColor);
+                InitPair(2, 181, bgColor);
+                InitPair(3, 217, bgColor);
+                InitPair(4, 218, bgColor);
+                InitPair(5, 224, bgColor);
+                InitPair(6, 225, bgColor);
+                InitPair(7, 231, bgColor);
             }
             break;
         }
@@ -630,28 +958,28 @@ void Cloud::SetColor(Color c) {
         {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 5;
-                init_pair(1, 5, bgColor);
-                init_pair(2, 13, bgColor);
-                init_pair(3, 11, bgColor);
-                init_pair(4, 14, bgColor);
-                init_pair(5, 15, bgColor);
+                InitPair(1, 5, bgColor);
+                InitPair(2, 13, bgColor);
+                InitPair(3, 11, bgColor);
+                InitPair(4, 14, bgColor);
+                InitPair(5, 15, bgColor);
             } else {
                 _numColorPairs = 15;
-                init_pair(1, 53, bgColor); // dark purple
-                init_pair(2, 54, bgColor);
-                init_pair(3, 55, bgColor);
-                init_pair(4, 134, bgColor); // light purple/pink
-                init_pair(5, 177, bgColor);
-                init_pair(6, 219, bgColor);
-                init_pair(7, 214, bgColor); // Orange/yellow
-                init_pair(8, 220, bgColor);
-                init_pair(9, 227, bgColor);
-                init_pair(10, 229, bgColor);
-                init_pair(11, 87, bgColor); // cyan
-                init_pair(12, 123, bgColor);
-                init_pair(13, 159, bgColor);
-                init_pair(14, 195, bgColor);
-                init_pair(15, 231, bgColor); // white
+                InitPair(1, 53, bgColor); // dark purple
+                InitPair(2, 54, bgColor);
+                InitPair(3, 55, bgColor);
+                InitPair(4, 134, bgColor); // light purple/pink
+                InitPair(5, 177, bgColor);
+                InitPair(6, 219, bgColor);
+                InitPair(7, 214, bgColor); // Orange/yellow
+                InitPair(8, 220, bgColor);
+                InitPair(9, 227, bgColor);
+                InitPair(10, 229, bgColor);
+                InitPair(11, 87, bgColor); // cyan
+                InitPair(12, 123, bgColor);
+                InitPair(13, 159, bgColor);
+                InitPair(14, 195, bgColor);
+                InitPair(15, 231, bgColor); // white
             }
             break;
         }
@@ -659,20 +987,20 @@ void Cloud::SetColor(Color c) {
         {
             if (_colorMode == ColorMode::COLOR16) {
                 _numColorPairs = 3;
-                init_pair(1, 8, bgColor);
-                init_pair(2, 7, bgColor);
-                init_pair(3, 15, bgColor);
+                InitPair(1, 8, bgColor);
+                InitPair(2, 7, bgColor);
+                InitPair(3, 15, bgColor);
             } else {
                 _numColorPairs = 9;
-                init_pair(1, 234, bgColor);
-                init_pair(2, 237, bgColor);
-                init_pair(3, 240, bgColor);
-                init_pair(4, 243, bgColor);
-                init_pair(5, 246, bgColor);
-                init_pair(6, 249, bgColor);
-                init_pair(7, 251, bgColor);
-                init_pair(8, 252, bgColor);
-                init_pair(9, 231, bgColor);
+                InitPair(1, 234, bgColor);
+                InitPair(2, 237, bgColor);
+                InitPair(3, 240, bgColor);
+                InitPair(4, 243, bgColor);
+                InitPair(5, 246, bgColor);
+                InitPair(6, 249, bgColor);
+                InitPair(7, 251, bgColor);
+                InitPair(8, 252, bgColor);
+                InitPair(9, 231, bgColor);
             }
             break;
         }
@@ -680,8 +1008,30 @@ void Cloud::SetColor(Color c) {
             break;
     }
 
-    int8_t lowPair, highPair;
-    if (_numColorPairs < 3) {
+    if (_colorMode == ColorMode::DIRECT) {
+        // The number of levels never changes, so the color map stays valid
+        // and the FrameBuffer only rewrites the cells whose RGB changed.
+        BuildRgbRamp();
+        _frameBuf.SetPalette(std::move(_palette));
+        return;
+    }
+
+    SetColorPairRange();
+    const size_t screenSize = _lines * _cols;
+    FillColorMap(screenSize);
+    BuildShadeLut();
+
+    _frameBuf.SetPalette(std::move(_palette));
+    ForceDrawEverything();
+}
+
+void Cloud::SetColorPairRange() {
+    int lowPair, highPair;
+    if (_colorMode == ColorMode::DIRECT) {
+        // Roughly the same span as pairs 2 through 5 of a 7 color palette
+        lowPair = 1 + (_numColorPairs - 1) / 6;
+        highPair = 1 + 4 * (_numColorPairs - 1) / 6;
+    } else if (_numColorPairs < 3) {
         lowPair = 1;
         highPair = 1;
     } else if (_numColorPairs == 3) {
@@ -691,17 +1041,67 @@ void Cloud::SetColor(Color c) {
         lowPair = 2;
         highPair = _numColorPairs - 2;
     }
-    _randColorPair.param(std::uniform_int_distribution<int>::param_type{lowPair, highPair});
-    _randColorPair.reset();
-    const size_t screenSize = _lines * _cols;
-    FillColorMap(screenSize);
+    _colorPairLow = lowPair;
+    _colorPairHigh = highPair;
+}
 
-    if (_colorMode != ColorMode::MONO)
-        bkgd(COLOR_PAIR(1));
-    ForceDrawEverything();
+// Interpolate the foreground colors of the pairs into a smooth RGB ramp with
+// DIRECT_COLOR_LEVELS entries. Colors redefined by InitColor() take priority
+// over the standard xterm values.
+void Cloud::BuildRgbRamp() {
+    vector<Rgb> keys;
+    for (size_t pair = 1; pair < _palette.pairs.size(); pair++)
+        keys.push_back(LookupRgb(_palette.pairs[pair].fg));
+    if (keys.empty())
+        keys.push_back(Rgb());
+
+    _numColorPairs = DIRECT_COLOR_LEVELS;
+    _glitchShade = (DIRECT_COLOR_LEVELS - 1) / 6;
+    _palette.ramp.resize(DIRECT_COLOR_LEVELS + 1);
+    const size_t numKeys = keys.size();
+    for (int level = 1; level <= DIRECT_COLOR_LEVELS; level++) {
+        const float pos = static_cast<float>(level - 1) * (numKeys - 1) / (DIRECT_COLOR_LEVELS - 1);
+        const size_t lowKey = min(static_cast<size_t>(pos), numKeys - 1);
+        const size_t highKey = min(lowKey + 1, numKeys - 1);
+        const float frac = pos - lowKey;
+        Rgb& rgb = _palette.ramp[level];
+        rgb.r = static_cast<uint8_t>(round(keys[lowKey].r + frac * (keys[highKey].r - keys[lowKey].r)));
+        rgb.g = static_cast<uint8_t>(round(keys[lowKey].g + frac * (keys[highKey].g - keys[lowKey].g)));
+        rgb.b = static_cast<uint8_t>(round(keys[lowKey].b + frac * (keys[highKey].b - keys[lowKey].b)));
+    }
+
+    const short bgColor = _palette.pairs.size() > 1 ? _palette.pairs[1].bg : -1;
+    _palette.defaultBg = (bgColor < 0);
+    _palette.bg = LookupRgb(bgColor);
+}
+
+Rgb Cloud::LookupRgb(short color) const {
+    // The last redefinition wins, just like calling init_color() repeatedly
+    for (auto it = _palette.colors.rbegin(); it != _palette.colors.rend(); ++it) {
+        if (it->color != color)
+            continue;
+        Rgb rgb;
+        rgb.r = static_cast<uint8_t>((it->r * 255 + 500) / 1000);
+        rgb.g = static_cast<uint8_t>((it->g * 255 + 500) / 1000);
+        rgb.b = static_cast<uint8_t>((it->b * 255 + 500) / 1000);
+        return rgb;
+    }
+    return ColorNumToRgb(color);
+}
+
+void Cloud::InitColor(short color, short r, short g, short b) {
+    _palette.colors.emplace_back(color, r, g, b);
+}
+
+void Cloud::InitPair(short pair, short fg, short bg) {
+    if (_palette.pairs.size() <= static_cast<size_t>(pair))
+        _palette.pairs.resize(pair + 1);
+    _palette.pairs[pair].fg = fg;
+    _palette.pairs[pair].bg = bg;
 }
 
 void Cloud::SpawnDroplets(high_resolution_clock::time_point curTime) {
+    TRACE_SCOPE("spawn");
     const nanoseconds elapsed = duration_cast<nanoseconds>(curTime - _lastSpawnTime);
     const float elapsedSec = static_cast<float>(elapsed.count() / 1e9);
     const size_t dropletsToSpawn = min(static_cast<size_t>(elapsedSec * _dropletsPerSec),
@@ -709,27 +1109,17 @@ void Cloud::SpawnDroplets(high_resolution_clock::time_point curTime) {
     if (!dropletsToSpawn)
         return;
 
-    size_t dropletIdx = 0;
     int dropletsSpawned = 0;
     for (size_t ii = 0; ii < dropletsToSpawn; ii++) {
-        uint16_t col = _randCol(mt);
-        if (_fullWidth)
-            col &= 0xFFFE;
-        if (!_colStat[col].canSpawn || _colStat[col].numDroplets >= _maxDropletsPerColumn)
-            continue;
-        Droplet* dropletToSpawn = nullptr;
-        for (; dropletIdx < _numDroplets; dropletIdx++) {
-            if (!_droplets[dropletIdx].IsAlive()) {
-                dropletToSpawn = &_droplets[dropletIdx];
-                break;
-            }
-        }
-        if (!dropletToSpawn)
+        // Only pick from the columns that can take another droplet
+        if (_spawnableCols.empty() || !_droplets.HasFreeSlot())
             break;
-        FillDroplet(dropletToSpawn, col);
-        dropletToSpawn->Activate(curTime);
-        _colStat[col].canSpawn = false;
-        _colStat[col].numDroplets++;
+        const uint32_t numSpawnable = static_cast<uint32_t>(_spawnableCols.size());
+        const uint16_t col = _spawnableCols[_spawnRng.Below(numSpawnable)];
+        ColumnStatus& cs = _colStat[col];
+        cs.droplets[cs.numDroplets++] = static_cast<uint32_t>(FillDroplet(col, curTime));
+        cs.canSpawn = false;
+        UpdateSpawnableCol(col);
         dropletsSpawned++;
     }
     if (dropletsSpawned)
@@ -744,20 +1134,47 @@ void Cloud::SetDropletDensity(float density) {
 
 void Cloud::SetColumnSpeeds() {
     for (auto& col : _colStat)
-        col.maxSpeedPct = _async ? _randSpeed(mt) : 1.0f;
+        col.maxSpeedPct = NewColumnSpeed();
+}
+
+float Cloud::NewColumnSpeed() {
+    return _async ? 0.3333333f + _spawnRng.Unit() * 0.6666667f : 1.0f;
 }
 
 void Cloud::UpdateDropletSpeeds() {
-    for (auto& droplet : _droplets) {
-        if (!droplet.IsAlive())
+    for (size_t idx = 0; idx < _droplets.GetSize(); idx++) {
+        if (!_droplets.IsAlive(idx))
             continue;
-        droplet.SetCharsPerSec(_colStat[droplet.GetCol()].maxSpeedPct * _charsPerSec);
+        _droplets.SetCharsPerSec(idx, _colStat[_droplets.GetCol(idx)].maxSpeedPct * _charsPerSec);
     }
 }
 
 void Cloud::SetColumnSpawn(uint16_t col, bool b) {
     assert(col < _colStat.size());
     _colStat[col].canSpawn = b;
+    UpdateSpawnableCol(col);
+}
+
+// Add or remove a column from _spawnableCols after its ColumnStatus changes
+void Cloud::UpdateSpawnableCol(uint16_t col) {
+    ColumnStatus& cs = _colStat[col];
+    const bool spawnable = cs.canSpawn && cs.numDroplets < _maxDropletsPerColumn &&
+        !(_fullWidth && (col & 1));
+    const bool listed = cs.spawnableIdx != 0xFFFF;
+    if (spawnable == listed)
+        return;
+
+    if (spawnable) {
+        cs.spawnableIdx = static_cast<uint16_t>(_spawnableCols.size());
+        _spawnableCols.push_back(col);
+    } else {
+        // Move the last entry into the hole
+        const uint16_t lastCol = _spawnableCols.back();
+        _spawnableCols[cs.spawnableIdx] = lastCol;
+        _colStat[lastCol].spawnableIdx = cs.spawnableIdx;
+        _spawnableCols.pop_back();
+        cs.spawnableIdx = 0xFFFF;
+    }
 }
 
 void Cloud::AddChars(wchar_t begin, wchar_t end) {
@@ -775,12 +1192,25 @@ void Cloud::SetGlitchPct(float pct) {
 }
 
 void Cloud::FillGlitchMap(size_t screenSize) {
-    if (!_glitchy)
+    _glitchThreshold = Rng::ChanceThreshold(_glitchPct);
+    if (!_glitchy || _hashAttrs)
         return;
-    _glitchMap.resize(screenSize);
+    _cellAttrs.resize(screenSize);
     for (size_t i = 0; i < screenSize; i++) {
-        _glitchMap[i] = _randChance(mt) <= _glitchPct;
+        const uint16_t glitched = _glitchRng.Chance(_glitchThreshold) ? CELL_GLITCHED : 0;
+        _cellAttrs[i] = (_cellAttrs[i] & CELL_COLOR_MASK) | glitched;
+    }
+
+    _glitchRowStart.resize(_cols + 1);
+    _glitchRows.clear();
+    for (uint16_t col = 0; col < _cols; col++) {
+        _glitchRowStart[col] = static_cast<uint32_t>(_glitchRows.size());
+        for (uint16_t line = 0; line < _lines; line++) {
+            if (_cellAttrs[CellIdx(line, col)] & CELL_GLITCHED)
+                _glitchRows.push_back(line);
+        }
     }
+    _glitchRowStart[_cols] = static_cast<uint32_t>(_glitchRows.size());
 }
 
 void Cloud::SetGlitchTimes(uint16_t low_ms, uint16_t high_ms) {
@@ -798,79 +1228,188 @@ void Cloud::SetMessage(const char* msg) {
         _message.emplace_back(*msg++);
 }
 
+void Cloud::ResizeCellAttrs(uint16_t oldLines, uint16_t oldCols) {
+    if (_hashAttrs)
+        return;
+    vector<uint16_t> oldAttrs;
+    oldAttrs.swap(_cellAttrs);
+    _cellAttrs.resize(static_cast<size_t>(_lines) * _cols);
+
+    // Copy what is left of each row (or column with AttrLayout::COLS) and
+    // fill in the rest
+    const bool byRows = _attrLayout == AttrLayout::ROWS;
+    const size_t numOuter = byRows ? _lines : _cols;
+    const size_t numInner = byRows ? _cols : _lines;
+    const size_t oldNumOuter = byRows ? oldLines : oldCols;
+    const size_t oldNumInner = byRows ? oldCols : oldLines;
+    const uint32_t low = static_cast<uint32_t>(_colorPairLow);
+    const uint32_t high = static_cast<uint32_t>(_colorPairHigh);
+    for (size_t outer = 0; outer < numOuter; outer++) {
+        uint16_t* pAttrs = &_cellAttrs[outer * numInner];
+        size_t numKept = 0;
+        if (outer < oldNumOuter) {
+            numKept = min(oldNumInner, numInner);
+            const auto oldBegin = oldAttrs.begin() + outer * oldNumInner;
+            copy(oldBegin, oldBegin + numKept, pAttrs);
+        }
+        for (size_t inner = numKept; inner < numInner; inner++) {
+            pAttrs[inner] = static_cast<uint16_t>(_colorRng.Range(low, high));
+            if (_glitchy && _glitchRng.Chance(_glitchThreshold))
+                pAttrs[inner] |= CELL_GLITCHED;
+        }
+    }
+    if (!_glitchy)
+        return;
+
+    // Keep the glitched rows that are still onscreen, then add the new ones
+    vector<uint32_t> oldRowStart;
+    vector<uint16_t> oldRows;
+    oldRowStart.swap(_glitchRowStart);
+    oldRows.swap(_glitchRows);
+    _glitchRowStart.resize(_cols + 1);
+    for (uint16_t col = 0; col < _cols; col++) {
+        _glitchRowStart[col] = static_cast<uint32_t>(_glitchRows.size());
+        uint16_t firstNewLine = 0;
+        if (col < oldCols) {
+            for (uint32_t rowIdx = oldRowStart[col]; rowIdx < oldRowStart[col + 1]; rowIdx++) {
+                if (oldRows[rowIdx] >= _lines)
+                    break;
+                _glitchRows.push_back(oldRows[rowIdx]);
+            }
+            firstNewLine = oldLines;
+        }
+        for (uint16_t line = firstNewLine; line < _lines; line++) {
+            if (_cellAttrs[CellIdx(line, col)] & CELL_GLITCHED)
+                _glitchRows.push_back(line);
+        }
+    }
+    _glitchRowStart[_cols] = static_cast<uint32_t>(_glitchRows.size());
+}
+
 void Cloud::FillColorMap(size_t screenSize) {
-    _colorPairMap.resize(screenSize);
+    if (_hashAttrs) {
+        _colorEpoch++;
+        return;
+    }
+    _cellAttrs.resize(screenSize);
+    const uint32_t low = static_cast<uint32_t>(_colorPairLow);
+    const uint32_t high = static_cast<uint32_t>(_colorPairHigh);
+    assert(high <= CELL_COLOR_MASK);
     for (size_t i = 0; i < screenSize; i++) {
-        _colorPairMap[i] = _randColorPair(mt);
+        const uint16_t colorPair = static_cast<uint16_t>(_colorRng.Range(low, high));
+        _cellAttrs[i] = (_cellAttrs[i] & CELL_GLITCHED) | colorPair;
     }
 }
 
 // Reset the position of all message chars and clear them.
-// The message is centered between the first and last quarter
-// of the screen.
+// The message is centered between the first and last quarter. Each line of
+// the message starts on a new screen line and wraps as needed.
 void Cloud::ResetMessage() {
     const uint16_t firstCol = _cols / 4;
     const uint16_t lastCol = 3 * _cols / 4;
     const uint16_t charsPerCol = lastCol - firstCol + 1;
-    const uint16_t msgLines = static_cast<uint16_t>(_message.size() / charsPerCol + 1);
-    const uint16_t firstLine = _lines / 2 - msgLines / 2;
-
-    size_t charsRemaining = _message.size();
-    uint16_t line = firstLine;
-    uint16_t col = firstCol;
-    if (charsRemaining < charsPerCol)
-        col += (charsPerCol - static_cast<uint16_t>(charsRemaining)) / 2;
-
-    for (auto& msgChar : _message) {
-        msgChar.draw = false;
-        if (line < _lines) {
-            msgChar.line = line;
-            msgChar.col = col;
+
+    size_t msgLines = 0;
+    size_t lineLen = 0;
+    for (const auto& msgChar : _message) {
+        if (msgChar.val == '\n') {
+            msgLines += lineLen / charsPerCol + 1;
+            lineLen = 0;
         } else {
-            msgChar.line = 0xFFFF;
-            msgChar.col = 0xFFFF;
+            lineLen++;
         }
-        if (col == lastCol) {
-            line++;
-            col = firstCol;
-            if (charsRemaining < charsPerCol) {
-                col += (charsPerCol - static_cast<uint16_t>(charsRemaining)) / 2;
+    }
+    msgLines += lineLen / charsPerCol + 1;
+    int line = max(0, _lines / 2 - static_cast<int>(msgLines / 2));
+
+    size_t lineBegin = 0;
+    while (lineBegin <= _message.size()) {
+        size_t lineEnd = lineBegin;
+        while (lineEnd < _message.size() && _message[lineEnd].val != '\n')
+            lineEnd++;
+
+        size_t charsRemaining = lineEnd - lineBegin;
+        uint16_t col = firstCol;
+        if (charsRemaining < charsPerCol)
+            col += (charsPerCol - static_cast<uint16_t>(charsRemaining)) / 2;
+        bool lineStarted = false;
+        for (size_t msgIdx = lineBegin; msgIdx < lineEnd; msgIdx++) {
+            MsgChr& msgChar = _message[msgIdx];
+            msgChar.draw = false;
+            if (line < _lines) {
+                msgChar.line = static_cast<uint16_t>(line);
+                msgChar.col = col;
+            } else {
+                msgChar.line = 0xFFFF;
+                msgChar.col = 0xFFFF;
             }
-        } else {
-            col++;
+            lineStarted = true;
+            if (col == lastCol) {
+                line++;
+                lineStarted = false;
+                col = firstCol;
+                if (charsRemaining < charsPerCol) {
+                    col += (charsPerCol - static_cast<uint16_t>(charsRemaining)) / 2;
+                }
+            } else {
+                col++;
+            }
+            charsRemaining--;
         }
-        charsRemaining--;
-    }
-}
-
-// Find which chars in the message should be drawn
-void Cloud::CalcMessage() {
-    wchar_t wc[2];
-    for (auto& msgChar : _message) {
-        if (msgChar.line == 0xFFFF || msgChar.col == 0xFFFF)
-            break;
+        if (lineStarted || lineBegin == lineEnd)
+            line++;
 
-        mvinnwstr(msgChar.line, msgChar.col, wc, 1);
-        if (wc[0] != 0 && wc[0] != ' ')
-            msgChar.draw = true;
+        if (lineEnd < _message.size()) {
+            _message[lineEnd].line = 0xFFFF; // The '\n' itself
+            _message[lineEnd].col = 0xFFFF;
+            _message[lineEnd].draw = false;
+        }
+        lineBegin = lineEnd + 1;
     }
-}
 
-void Cloud::DrawMessage() const {
+    // Sort the onscreen chars by column. Within a column, message order is
+    // already line order.
+    _msgColStart.assign(_cols + 1, 0);
     for (const auto& msgChar : _message) {
-        if (!msgChar.draw)
-            continue;
-
-        const attr_t attr = (_boldMode == BoldMode::OFF) ? A_NORMAL : A_BOLD;
-        cchar_t wc = {};
-        wc.attr = attr;
-        wc.chars[0] = msgChar.val;
-        if (_colorMode != ColorMode::MONO)
-            attron(COLOR_PAIR(_numColorPairs));
+        if (msgChar.col != 0xFFFF)
+            _msgColStart[msgChar.col + 1]++;
+    }
+    for (uint16_t col = 0; col < _cols; col++)
+        _msgColStart[col + 1] += _msgColStart[col];
+    _msgByCol.resize(_msgColStart[_cols]);
+    vector<uint32_t> nextSlot(_msgColStart.begin(), _msgColStart.end() - 1);
+    for (size_t msgIdx = 0; msgIdx < _message.size(); msgIdx++) {
+        const uint16_t col = _message[msgIdx].col;
+        if (col != 0xFFFF)
+            _msgByCol[nextSlot[col]++] = static_cast<uint32_t>(msgIdx);
+    }
+}
 
-        mvadd_wch(msgChar.line, msgChar.col, &wc);
+// Droplets only change the columns they are in, so only those columns need
+// their message chars revealed or drawn back on top
+void Cloud::UpdateMessage() {
+    TRACE_SCOPE("message");
+    if (_forceDrawEverything) {
+        for (uint16_t col = 0; col < _cols; col++)
+            UpdateMessageCol(col);
+        return;
+    }
+    for (const uint32_t idx : _droplets.GetVisited())
+        UpdateMessageCol(_droplets.GetCol(idx));
+}
 
-        if (_colorMode != ColorMode::MONO)
-            attroff(COLOR_PAIR(_numColorPairs));
+// A message char is revealed once a droplet has drawn over it
+void Cloud::UpdateMessageCol(uint16_t col) {
+    const bool isBold = (_boldMode != BoldMode::OFF);
+    for (uint32_t colIdx = _msgColStart[col]; colIdx < _msgColStart[col + 1]; colIdx++) {
+        MsgChr& msgChar = _message[_msgByCol[colIdx]];
+        if (!msgChar.draw) {
+            const wchar_t val = _frameBuf.Get(msgChar.line, msgChar.col).val;
+            if (val == 0 || val == ' ')
+                continue;
+            msgChar.draw = true;
+        }
+        _frameBuf.Put(msgChar.line, msgChar.col, static_cast<wchar_t>(msgChar.val),
+                      static_cast<uint16_t>(_numColorPairs), isBold);
     }
 }
@@ -23,9 +23,15 @@
 #define CLOUD_H
 
 #include "droplet.h"
+#include "framebuffer.h"
 #include "neo.h"
+#include "profiler.h"
+#include "rng.h"
+#include "trace.h"
+#include "workerpool.h"
 
-#include <random>
+#include <cmath>
+#include <memory>
 #include <vector>
 
 #ifdef __APPLE__
@@ -42,7 +48,8 @@ using namespace std;
 
 class Cloud {
 public:
-    Cloud(ColorMode cm, bool def2ascii); // Must be called *AFTER* InitCurses
+    // Must be called *AFTER* InitCurses unless SetScreenSize() is used
+    Cloud(ColorMode cm, bool def2ascii);
 
     enum class ShadingMode : unsigned {
         RANDOM,
@@ -55,17 +62,40 @@ public:
         ALL,
         INVALID
     };
+    enum class AttrLayout : unsigned {
+        ROWS, // Same order as the FrameBuffer and the terminal output
+        COLS // Same order that Droplets draw in
+    };
 
     void Rain();
     void Reset();
+    void Resize(); // Call when the terminal's size changes
+    // The earliest time that Rain() will change something onscreen. This is
+    // time_point::max() if nothing will happen until the user presses a key.
+    high_resolution_clock::time_point NextEventTime() const;
 
     struct CharAttr {
         int colorPair;
         bool isBold;
     };
-    void GetAttr(uint16_t line, uint16_t col, wchar_t val, Droplet::CharLoc ct,
-                 CharAttr* pAttr, high_resolution_clock::time_point time,
-                 uint16_t headPutLine, uint16_t len) const;
+    // The DISTANCE_FROM_HEAD color pair of a char distance lines above the
+    // head of a Droplet with the given length, before glitching and clamping
+    int GetShade(uint16_t length, int distance) const {
+        if (length <= _shadeLutLength && distance <= length)
+            return _shadeLut[static_cast<size_t>(length) * (length + 1) / 2 + distance];
+        return CalcShade(length, distance);
+    }
+    // BOLD, SHADING, and GLITCHY must match the current modes. See
+    // DropletPool::SelectDrawPath().
+    template <unsigned BOLD, unsigned SHADING, bool GLITCHY>
+    void GetAttr(uint16_t line, uint16_t col, wchar_t val, DropletPool::CharLoc ct,
+                 CharAttr* pAttr, uint16_t headPutLine, uint16_t len) const;
+    // Without --hashattrs, Cloud keeps a sorted list of the glitched rows in
+    // each column. GetGlitchedRows() sets [*ppBegin, *ppEnd) to the ones from
+    // firstLine to lastLine.
+    bool HasGlitchIndex() const { return !_hashAttrs; }
+    void GetGlitchedRows(uint16_t col, uint16_t firstLine, uint16_t lastLine,
+                         const uint16_t** ppBegin, const uint16_t** ppEnd) const;
 
     float GetCharsPerSec() const { return _charsPerSec; }
     void SetCharsPerSec(float cps);
@@ -74,10 +104,12 @@ public:
 
     static constexpr size_t CHAR_POOL_SIZE = 2048;
     static constexpr size_t GLITCH_POOL_SIZE = 1024;
+    static constexpr int DIRECT_COLOR_LEVELS = 64; // Shades per palette in DIRECT mode
+    static constexpr uint64_t DEFAULT_SEED = 0x1234567;
 
     void ForceDrawEverything() { _forceDrawEverything = true; }
     ShadingMode GetShadingMode() const { return _shadingMode; }
-    void SetShadingMode(ShadingMode sm) { _shadingMode = sm; ForceDrawEverything(); }
+    void SetShadingMode(ShadingMode sm);
     void TogglePause();
     Color GetColor() const { return _color; }
     void SetColor(Color c);
@@ -94,40 +126,86 @@ public:
     void InitChars();
     bool Raining() { return _raining; }
     void SetRaining(bool b) { _raining = b; }
-    void SetBoldMode(BoldMode bm) { _boldMode = bm; }
+    void SetBoldMode(BoldMode bm) { _boldMode = bm; UpdateDrawPath(); }
     float GetGlitchPct() const { return _glitchPct; }
     void SetGlitchPct(float pct);
     void SetGlitchTimes(uint16_t low_ms, uint16_t high_ms);
+    void SetNumGlitchGroups(uint16_t num) { _glitchGroupsOpt = num; } // 0 for the default
     bool GetGlitchy() const { return _glitchy; }
-    void SetGlitchy(bool b) { _glitchy = b; }
+    void SetGlitchy(bool b) { _glitchy = b; UpdateDrawPath(); }
     void SetShortPct(float pct) { _shortPct = pct; }
     void SetDieEarlyPct(float pct) { _dieEarlyPct = pct; }
     void SetLingerTimes(uint16_t low_ms, uint16_t high_ms);
 
-    void SetMessage(const char* msg);
+    void SetMessage(const char* msg); // Lines are separated by '\n'
     ColorMode GetColorMode() const { return _colorMode; }
     uint16_t GetLines() const { return _lines; }
     uint16_t GetCols() const { return _cols; }
     void SetColumnSpawn(uint16_t col, bool b);
     void SetMaxDropletsPerColumn(uint8_t val) { _maxDropletsPerColumn = val; }
+    void SetNumThreads(unsigned numThreads); // 1 keeps everything on the calling thread
+    void SetSeed(uint64_t seed) { _seed = seed; } // Takes effect on InitChars()/Reset()
+    void SetHashAttrs(bool b) { _hashAttrs = b; }
+    void SetAttrLayout(AttrLayout al) { _attrLayout = al; } // Call before Reset()
     void SetUserColors(vector<ColorContent>&& vals) { _usrColors = std::move(vals); }
+    FrameBuffer* GetFrameBuffer() { return &_frameBuf; }
+    size_t GetNumLiveDroplets() const { return _droplets.GetNumAlive(); }
+    size_t GetNumDroplets() const { return _numDroplets; } // Live or not
+    uint16_t GetHeadColor() const { return static_cast<uint16_t>(_numColorPairs); }
+    // Rain() marks the end of each of its stages on pProfiler (nullptr for none).
+    // This also attaches the calling thread and any worker threads to it.
+    void SetProfiler(Profiler* pProfiler);
+
+    // Use a fixed screen size instead of the ncurses LINES/COLS
+    void SetScreenSize(uint16_t lines, uint16_t cols);
+    // Time only moves when AdvanceVirtualClock() is called
+    void UseVirtualClock();
+    bool UsesVirtualClock() const { return _useVirtualClock; }
+    void AdvanceVirtualClock(nanoseconds ns) { _virtualTime += ns; }
+    high_resolution_clock::time_point Now() const {
+        return _useVirtualClock ? _virtualTime : high_resolution_clock::now();
+    }
 
 private:
-    vector<Droplet> _droplets = {};
+    DropletPool _droplets;
     size_t _numDroplets = 0;
 
     // ncurses can change the LINES/COLS variables. So keep a local copy, lest
     // we overrun some buffer.
     uint16_t _lines = 25;
     uint16_t _cols = 80;
+    bool _fixedSize = false; // Ignore LINES/COLS
+    bool _useVirtualClock = false;
+    high_resolution_clock::time_point _virtualTime = {};
     Charset _charset = Charset::NONE;
     vector<wchar_t> _chars = {}; // The chars that can be displayed
     vector<wchar_t> _userChars = {}; // chars passed directly from the user
     vector<wchar_t> _charPool = {}; // Precomputed random chars
     vector<wchar_t> _glitchPool = {}; // Precomputed random chars used for glitching
     size_t _glitchPoolIdx = 0;
-    vector<bool> _glitchMap = {}; // Which screen positions are glitched
-    vector<int> _colorPairMap = {}; // Color for each screen position
+    // The color pair and glitch flag for each screen position, packed into
+    // one array laid out according to _attrLayout (see CellIdx())
+    vector<uint16_t> _cellAttrs = {};
+    static constexpr uint16_t CELL_COLOR_MASK = 0x7FFF;
+    static constexpr uint16_t CELL_GLITCHED = 0x8000;
+    AttrLayout _attrLayout = AttrLayout::ROWS;
+    // With _hashAttrs, _cellAttrs stays empty. Instead, each cell's color
+    // and glitchiness come from hashing its position, so a resize or a
+    // color/glitch change does not need to touch every cell.
+    bool _hashAttrs = false;
+    uint32_t _colorEpoch = 0; // Bumped to reshuffle the hashed colors
+    uint64_t _glitchThreshold = 0; // Rng::ChanceThreshold(_glitchPct)
+    // The glitched rows of column c are _glitchRows[_glitchRowStart[c]] up to
+    // _glitchRows[_glitchRowStart[c + 1]]. Built by FillGlitchMap().
+    vector<uint32_t> _glitchRowStart = {};
+    vector<uint16_t> _glitchRows = {};
+    // GetShade() for every length up to _shadeLutLength and every distance
+    // up to that length, stored as a triangle. Only built for
+    // DISTANCE_FROM_HEAD. The triangle grows with the square of the length,
+    // so longer Droplets call CalcShade() instead.
+    vector<int16_t> _shadeLut = {};
+    uint16_t _shadeLutLength = 0;
+    static constexpr uint16_t MAX_SHADE_LUT_LENGTH = 1024;
     float _dropletDensity = 1.0f; // How many columns should have droplets
     float _dropletsPerSec = 5.0f; // Number of droplets to spawn each second
     static constexpr size_t MAX_DROPLETS_PER_COL = 4;
@@ -135,10 +213,35 @@ private:
         float maxSpeedPct; // how fast droplets in this column travel
         uint8_t numDroplets;
         bool canSpawn; // true if more droplets can be added to this column
+        uint16_t spawnableIdx; // Position in _spawnableCols (0xFFFF if absent)
+        uint32_t droplets[MAX_DROPLETS_PER_COL]; // The first numDroplets are live
     };
     vector<ColumnStatus> _colStat = {};
-    high_resolution_clock::time_point _lastGlitchTime = {};
-    high_resolution_clock::time_point _nextGlitchTime = {};
+    vector<uint16_t> _spawnableCols = {}; // Columns that SpawnDroplets() may pick
+    // The columns are split into glitch groups (--glitchgroups) that each
+    // glitch on their own schedule, so that the redraws are spread out over
+    // many frames. Each group has one pending event in _glitchWheel for its
+    // next glitch or phase change.
+    struct GlitchGroup {
+        high_resolution_clock::time_point lastTime;
+        high_resolution_clock::time_point nextTime;
+        uint8_t phase; // 0: bright, 1: normal, 2: dim
+        bool isGlitching; // Glitching this frame
+        bool isChanged; // The group's glitched chars must be redrawn this frame
+    };
+    vector<GlitchGroup> _glitchGroups = {};
+    vector<uint8_t> _colGlitchGroup = {}; // Which group each column is in
+    // The columns of each group, sorted by group. The columns of group g are
+    // _glitchGroupCols[_glitchGroupColStart[g]] up to the start of g + 1.
+    vector<uint32_t> _glitchGroupColStart = {};
+    vector<uint16_t> _glitchGroupCols = {};
+    vector<uint32_t> _glitchVisits = {}; // The Droplets in the changed groups
+    uint16_t _numGlitchGroups = 1;
+    uint16_t _glitchGroupsOpt = 0; // --glitchgroups, or 0 to go by the column count
+    static constexpr uint16_t COLS_PER_GLITCH_GROUP = 4;
+    static constexpr uint16_t MAX_GLITCH_GROUPS = 256;
+    TimingWheel _glitchWheel = {};
+    vector<TimingWheel::Event> _dueGlitches = {}; // The groups handled this frame
     high_resolution_clock::time_point _pauseTime = {};
     high_resolution_clock::time_point _lastSpawnTime = {};
     float _charsPerSec = 8.0f; // Neo/Cypher scene is ~8.3333333f
@@ -170,36 +273,155 @@ private:
         bool draw = false;
     };
     vector<MsgChr> _message = {};
+    // The onscreen message chars sorted by column and then line. The chars in
+    // column c are _message[_msgByCol[_msgColStart[c]]] up to
+    // _message[_msgByCol[_msgColStart[c + 1]]]. This lets UpdateMessage() only
+    // look at the columns that were drawn in, whatever the message's length.
+    vector<uint32_t> _msgColStart = {};
+    vector<uint32_t> _msgByCol = {};
 
-    // RNG stuff
-    mt19937 mt {};
-    uniform_int_distribution<int> _randColorPair {};
-    uniform_real_distribution<float> _randChance {};
-    uniform_int_distribution<uint16_t> _randLine {};
-    uniform_int_distribution<uint16_t> _randCpIdx {};
-    uniform_int_distribution<uint16_t> _randLen {};
-    uniform_int_distribution<uint16_t> _randCol {};
-    uniform_int_distribution<uint16_t> _randGlitchMs {};
-    uniform_int_distribution<uint16_t> _randLingerMs {};
-    uniform_int_distribution<size_t> _randCharIdx {};
-    uniform_real_distribution<float> _randSpeed {};
+    // RNG stuff. Each subsystem has its own stream, so changing how often
+    // one of them draws numbers does not change what the others do.
+    uint64_t _seed = DEFAULT_SEED;
+    Rng _spawnRng = {}; // Droplets, spawn columns, and column speeds
+    Rng _glitchRng = {}; // Glitch map and glitch times
+    Rng _colorRng = {}; // Color map
+    Rng _charRng = {}; // Character and glitch pools
+    enum RngStream : uint64_t {
+        SPAWN_STREAM = 1,
+        GLITCH_STREAM,
+        COLOR_STREAM,
+        CHAR_STREAM,
+        GLITCH_GROUP_STREAM
+    };
+    int _colorPairLow = 1;
+    int _colorPairHigh = 1;
 
     ColorMode _colorMode = ColorMode::MONO;
     int _numColorPairs = 7;
+    int _glitchShade = 1; // How many shades brighter/dimmer glitched chars get
     vector<ColorContent> _usrColors = {};
+    Palette _palette = {}; // Built up by SetColor()
+    FrameBuffer _frameBuf = {};
 
-    bool TimeForGlitch(high_resolution_clock::time_point time) const;
-    void DoGlitch(const Droplet& droplet);
-    bool IsBright(high_resolution_clock::time_point time) const;
-    bool IsDim(high_resolution_clock::time_point time) const;
-    void FillDroplet(Droplet* pDroplet, uint16_t col);
+    // Multithreading. The screen is split into tiles of TILE_COLS columns. A
+    // droplet only touches its own column, so tiles can be worked on at once.
+    static constexpr uint16_t TILE_COLS = 32;
+    static constexpr size_t MIN_THREADED_DROPLETS = 256;
+    struct Tile {
+        vector<uint32_t> droplets = {}; // This frame's droplets in the tile
+        DropletPool::Deferred deferred = {};
+        vector<uint32_t> dirty = {}; // Cells drawn this frame
+    };
+    vector<Tile> _tiles = {};
+    DropletPool::Deferred _deferred = {}; // Every tile's changes, merged
+    unique_ptr<WorkerPool> _pWorkers = {};
+    high_resolution_clock::time_point _frameTime = {}; // Rain()'s curTime for the workers
+    Profiler* _pProfiler = nullptr;
+    TRACE_ONLY(uint32_t _numGlitchedChars = 0;) // This frame's, for --trace
+
+    void Mark(Profiler::Stage stage) {
+        if (_pProfiler)
+            _pProfiler->Mark(stage);
+    }
+
+    void AssignGlitchGroups();
+    void ResetGlitchGroups(high_resolution_clock::time_point curTime);
+    // Glitches and updates the groups whose event is due. Returns true if any
+    // group's glitched chars have to be redrawn.
+    bool UpdateGlitchGroups(high_resolution_clock::time_point curTime);
+    void ClearGlitchGroups(); // Call once this frame's groups have been drawn
+    // Fills _glitchVisits with the live Droplets of the changed groups
+    void CollectGlitchVisits();
+    void ScheduleGlitchGroup(size_t groupIdx);
+    uint8_t CalcGlitchPhase(const GlitchGroup& group, high_resolution_clock::time_point time) const;
+    const GlitchGroup& GetGlitchGroup(uint16_t col) const { return _glitchGroups[_colGlitchGroup[col]]; }
+    bool NeedsDraw(size_t dropletIdx) const;
+    void DoGlitch(size_t dropletIdx);
+    void GlitchChar(uint16_t charPoolIdx, uint16_t line);
+    void CheckDropletDeath(size_t dropletIdx);
+    void RainThreaded(high_resolution_clock::time_point curTime, bool visitAll);
+    void RunTiles(WorkerPool* pWorkers, WorkerPool::TaskFunc func);
+    static void AdvanceTile(void* pCtx, size_t tileIdx);
+    static void DrawTile(void* pCtx, size_t tileIdx);
+    static void AttachProfilerThread(void* pCtx, size_t threadIdx);
+    size_t FillDroplet(uint16_t col, high_resolution_clock::time_point curTime);
+    void UpdateSpawnableCol(uint16_t col);
+    float NewColumnSpeed();
 
     void SpawnDroplets(high_resolution_clock::time_point curTime);
     void FillColorMap(size_t screenSize);
     void FillGlitchMap(size_t screenSize);
+    void ResizeCellAttrs(uint16_t oldLines, uint16_t oldCols); // Call after _lines/_cols change
+    int GetColorPair(uint16_t line, uint16_t col) const;
+    size_t CellIdx(uint16_t line, uint16_t col) const {
+        if (_attrLayout == AttrLayout::ROWS)
+            return static_cast<size_t>(line) * _cols + col;
+        return static_cast<size_t>(col) * _lines + line;
+    }
+    static uint64_t CellKey(uint16_t line, uint16_t col) {
+        return (static_cast<uint64_t>(col) << 16) | line;
+    }
     void ResetMessage();
-    void CalcMessage();
-    void DrawMessage() const;
+    void UpdateMessage();
+    void UpdateMessageCol(uint16_t col);
+    void InitColor(short color, short r, short g, short b);
+    void InitPair(short pair, short fg, short bg);
+    bool UsesRgb() const { return _colorMode == ColorMode::TRUECOLOR || _colorMode == ColorMode::DIRECT; }
+    void SetColorPairRange();
+    void BuildRgbRamp();
+    Rgb LookupRgb(short color) const;
+    int CalcShade(uint16_t length, int distance) const {
+        return _numColorPairs -
+            static_cast<int>(round(static_cast<float>(distance) / length *
+                                   static_cast<float>(_numColorPairs - 1)));
+    }
+    void BuildShadeLut();
+    void UpdateDrawPath() {
+        _droplets.SelectDrawPath(static_cast<unsigned>(_boldMode),
+                                 static_cast<unsigned>(_shadingMode), _glitchy);
+    }
 };
 
+template <unsigned BOLD, unsigned SHADING, bool GLITCHY>
+void Cloud::GetAttr(uint16_t line, uint16_t col, wchar_t val, DropletPool::CharLoc ct,
+                    CharAttr* pAttr, uint16_t headPutLine, uint16_t length) const {
+    if (BOLD == static_cast<unsigned>(BoldMode::RANDOM))
+        pAttr->isBold = ((line ^ val) % 2 == 1);
+    if (SHADING == static_cast<unsigned>(ShadingMode::DISTANCE_FROM_HEAD)) {
+        pAttr->colorPair = GetShade(length, headPutLine - line);
+    } else {
+        pAttr->colorPair = GetColorPair(line, col);
+    }
+    if (GLITCHY && IsGlitched(line, col)) {
+        const uint8_t phase = GetGlitchGroup(col).phase;
+        if (phase == 0) {
+            pAttr->colorPair += _glitchShade;
+            pAttr->isBold = true;
+        } else if (phase == 2) {
+            pAttr->colorPair -= _glitchShade;
+            pAttr->isBold = false;
+        }
+    }
+    switch (ct) {
+        case DropletPool::CharLoc::TAIL:
+            pAttr->colorPair = 1;
+            pAttr->isBold = false;
+            break;
+        case DropletPool::CharLoc::HEAD:
+            pAttr->colorPair = _numColorPairs;
+            pAttr->isBold = true;
+            break;
+        case DropletPool::CharLoc::MIDDLE: // fallthrough
+        default:
+            pAttr->colorPair = min(pAttr->colorPair, _numColorPairs - 1);
+            pAttr->colorPair = max(pAttr->colorPair, 1);
+            break;
+    }
+    if (BOLD == static_cast<unsigned>(BoldMode::OFF))
+        pAttr->isBold = false;
+    else if (BOLD == static_cast<unsigned>(BoldMode::ALL))
+        pAttr->isBold = true;
+}
+
 #endif
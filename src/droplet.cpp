@@ -1,5 +1,5 @@
 /*
-    droplet.cpp - Implements the Droplet class
+    droplet.cpp - Implements the DropletPool class
 
     Copyright (C) 2021 Stewart Reive
 
@@ -19,156 +19,463 @@
 
 #include "droplet.h"
 #include "cloud.h"
+#include "trace.h"
 
-Droplet::Droplet() {
-    Reset();
-}
-
-Droplet::Droplet(Cloud* cl, uint16_t col, uint16_t endLine, uint16_t cpIdx,
-                 uint16_t len, float cps, milliseconds ttl) {
-    Reset();
-    _pCloud = cl;
-    _boundCol = col;
-    _endLine = endLine;
-    _charPoolIdx = cpIdx;
-    _length = len;
-    _charsPerSec = cps;
-    _timeToLinger = ttl;
-}
-
-void Droplet::Reset() {
-    _pCloud = nullptr;
-    _isAlive = false;
-    _isHeadCrawling = false;
-    _isTailCrawling = false;
-    _boundCol = 0xFFFF;
-    _headPutLine = 0;
-    _headCurLine = 0;
-    _tailPutLine = 0xFFFF;
-    _tailCurLine = 0;
-    _endLine = 0xFFFF;
-    _charPoolIdx = 0xFFFF;
-    _length = 0xFFFF;
-    _charsPerSec = 0.0f;
-    _lastTime = high_resolution_clock::time_point();
-    _headStopTime = high_resolution_clock::time_point();
-    _timeToLinger = milliseconds(0);
-}
-
-void Droplet::Activate(high_resolution_clock::time_point curTime) {
-    _isAlive = true;
-    _isHeadCrawling = true;
-    _isTailCrawling = true;
-    _lastTime = curTime;
-}
-
-void Droplet::Advance(high_resolution_clock::time_point curTime) {
-    uint64_t elapsedNs = duration_cast<nanoseconds>(curTime - _lastTime).count();
-    const float elapsedSec = elapsedNs / 1.0e9f;
-    uint16_t charsAdvanced = static_cast<uint16_t>(round(_charsPerSec * elapsedSec));
-    if (!charsAdvanced)
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <limits>
+
+static int64_t ToNs(high_resolution_clock::time_point time) {
+    return duration_cast<nanoseconds>(time.time_since_epoch()).count();
+}
+
+constexpr int64_t DropletPool::HEAD_BRIGHT_NS;
+
+void DropletPool::Resize(size_t numDroplets, high_resolution_clock::time_point curTime) {
+    _isAlive.clear();
+    _isHeadCrawling.clear();
+    _isTailCrawling.clear();
+    _boundCol.clear();
+    _headPutLine.clear();
+    _headCurLine.clear();
+    _tailPutLine.clear();
+    _tailCurLine.clear();
+    _endLine.clear();
+    _charPoolIdx.clear();
+    _length.clear();
+    _speedFx.clear();
+    _posFx.clear();
+    _lastNs.clear();
+    _headStopNs.clear();
+    _lingerMs.clear();
+    _eventGen.clear();
+    _isDue.clear();
+    _hasMoved.clear();
+    _freeSlots.clear();
+    Grow(numDroplets);
+    _wheel.Reset(ToNs(curTime));
+    _visited.clear();
+}
+
+void DropletPool::Grow(size_t numDroplets) {
+    const size_t oldSize = _isAlive.size();
+    if (numDroplets <= oldSize)
+        return;
+    _isAlive.resize(numDroplets, 0);
+    _isHeadCrawling.resize(numDroplets, 0);
+    _isTailCrawling.resize(numDroplets, 0);
+    _boundCol.resize(numDroplets, 0xFFFF);
+    _headPutLine.resize(numDroplets, 0);
+    _headCurLine.resize(numDroplets, 0);
+    _tailPutLine.resize(numDroplets, 0xFFFF);
+    _tailCurLine.resize(numDroplets, 0);
+    _endLine.resize(numDroplets, 0xFFFF);
+    _charPoolIdx.resize(numDroplets, 0xFFFF);
+    _length.resize(numDroplets, 0xFFFF);
+    _speedFx.resize(numDroplets, 0);
+    _posFx.resize(numDroplets, 0);
+    _lastNs.resize(numDroplets, 0);
+    _headStopNs.resize(numDroplets, 0);
+    _lingerMs.resize(numDroplets, 0);
+    _eventGen.resize(numDroplets, 0);
+    _isDue.resize(numDroplets, 0);
+    _hasMoved.resize(numDroplets, 0);
+    _visited.reserve(numDroplets);
+
+    // Pop the lowest indices first. The new slots go under the old ones.
+    vector<uint32_t> newSlots;
+    newSlots.reserve(numDroplets - oldSize);
+    for (size_t idx = numDroplets; idx > oldSize; idx--)
+        newSlots.push_back(static_cast<uint32_t>(idx - 1));
+    _freeSlots.insert(_freeSlots.begin(), newSlots.begin(), newSlots.end());
+}
+
+void DropletPool::Reshape(size_t numDroplets, uint16_t oldLines, uint16_t lines, uint16_t cols,
+                          vector<uint32_t>* pKilled) {
+    const uint16_t lastLine = lines - 1;
+    for (size_t idx = 0; idx < _isAlive.size(); idx++) {
+        if (!_isAlive[idx])
+            continue;
+        // Nothing is left of a Droplet whose tail is already past the bottom
+        if (_boundCol[idx] >= cols || (_tailPutLine[idx] != 0xFFFF && _tailPutLine[idx] >= lastLine)) {
+            Kill(idx, nullptr);
+            pKilled->push_back(static_cast<uint32_t>(idx));
+            continue;
+        }
+        if (_endLine[idx] > lastLine)
+            _endLine[idx] = lastLine;
+        else if (_isHeadCrawling[idx] && _endLine[idx] == oldLines - 1)
+            _endLine[idx] = lastLine; // It was headed for the bottom, so follow it down
+        _headPutLine[idx] = min(_headPutLine[idx], lastLine);
+        _headCurLine[idx] = min(_headCurLine[idx], lastLine);
+        if (_length[idx] == oldLines || _length[idx] > lines)
+            _length[idx] = lines;
+        _hasMoved[idx] = 1;
+    }
+    // Live Droplets keep their indices, so the pool only ever grows here
+    Grow(numDroplets);
+}
+
+size_t DropletPool::Spawn(uint16_t col, uint16_t endLine, uint16_t cpIdx,
+                          uint16_t len, float cps, milliseconds ttl,
+                          high_resolution_clock::time_point curTime) {
+    assert(!_freeSlots.empty());
+    const size_t idx = _freeSlots.back();
+    _freeSlots.pop_back();
+
+    _isAlive[idx] = 1;
+    _isHeadCrawling[idx] = 1;
+    _isTailCrawling[idx] = 1;
+    _boundCol[idx] = col;
+    _headPutLine[idx] = 0;
+    _headCurLine[idx] = 0;
+    _tailPutLine[idx] = 0xFFFF;
+    _tailCurLine[idx] = 0;
+    _endLine[idx] = endLine;
+    _charPoolIdx[idx] = cpIdx;
+    _length[idx] = len;
+    _speedFx[idx] = CharsPerSecToFx(cps);
+    _posFx[idx] = FX_ONE / 2; // The first char appears after half a char's time
+    _lastNs[idx] = ToNs(curTime);
+    _headStopNs[idx] = 0;
+    _lingerMs[idx] = ttl.count();
+    _hasMoved[idx] = 1;
+    ScheduleAt(idx, _lastNs[idx], nullptr); // Draw the first char this frame
+    return idx;
+}
+
+uint64_t DropletPool::CharsPerSecToFx(float cps) {
+    return static_cast<uint64_t>(llround(static_cast<double>(cps) * FX_ONE / 1.0e9));
+}
+
+void DropletPool::Kill(size_t idx, Deferred* pDeferred) {
+    _isAlive[idx] = 0;
+    if (pDeferred)
+        pDeferred->freed.push_back(static_cast<uint32_t>(idx));
+    else
+        _freeSlots.push_back(static_cast<uint32_t>(idx));
+}
+
+void DropletPool::SetCharsPerSec(size_t idx, float cps) {
+    _speedFx[idx] = CharsPerSecToFx(cps);
+    ScheduleNext(idx, _lastNs[idx], nullptr);
+}
+
+void DropletPool::Advance(high_resolution_clock::time_point curTime, bool visitAll,
+                          const vector<uint32_t>& alsoVisit) {
+    TRACE_SCOPE("advance");
+    // Update in index order, the same order that ApplyDeferred() uses, so
+    // that the threaded path runs the same simulation
+    CollectDue(curTime, visitAll, alsoVisit);
+    for (const uint32_t idx : _visited)
+        AdvanceDue(idx, curTime, nullptr);
+}
+
+void DropletPool::CollectDue(high_resolution_clock::time_point curTime, bool visitAll,
+                             const vector<uint32_t>& alsoVisit) {
+    TRACE_SCOPE("collect due");
+    const int64_t curNs = ToNs(curTime);
+
+    _visited.clear();
+    if (visitAll) {
+        for (size_t idx = 0; idx < _isAlive.size(); idx++) {
+            if (_isAlive[idx])
+                _visited.push_back(static_cast<uint32_t>(idx));
+        }
+    }
+
+    _due.clear();
+    _wheel.PopDue(curNs, &_due);
+    for (const auto& event : _due) {
+        const size_t idx = event.id;
+        if (!_isAlive[idx] || event.gen != _eventGen[idx])
+            continue; // Superseded by a later event
+        if (!visitAll)
+            _visited.push_back(event.id);
+        _isDue[idx] = 1;
+    }
+    FinishVisited(visitAll, alsoVisit);
+}
+
+void DropletPool::FinishVisited(bool visitAll, const vector<uint32_t>& alsoVisit) {
+    if (visitAll)
+        return; // Already complete and in order
+    for (const uint32_t idx : alsoVisit) {
+        if (_isAlive[idx])
+            _visited.push_back(idx);
+    }
+    sort(_visited.begin(), _visited.end());
+    _visited.erase(unique(_visited.begin(), _visited.end()), _visited.end());
+}
+
+void DropletPool::AdvanceDue(size_t idx, high_resolution_clock::time_point curTime,
+                             Deferred* pDeferred) {
+    if (!_isDue[idx])
         return;
+    _isDue[idx] = 0;
+    Update(idx, ToNs(curTime), pDeferred);
+}
+
+void DropletPool::MergeDeferred(Deferred* pFrom, Deferred* pInto) {
+    pInto->spawners.insert(pInto->spawners.end(), pFrom->spawners.begin(), pFrom->spawners.end());
+    pInto->freed.insert(pInto->freed.end(), pFrom->freed.begin(), pFrom->freed.end());
+    pInto->events.insert(pInto->events.end(), pFrom->events.begin(), pFrom->events.end());
+    pFrom->spawners.clear();
+    pFrom->freed.clear();
+    pFrom->events.clear();
+}
+
+void DropletPool::ApplyDeferred(Deferred* pDeferred) {
+    // Each Droplet adds at most one entry to each list per frame
+    sort(pDeferred->spawners.begin(), pDeferred->spawners.end());
+    sort(pDeferred->freed.begin(), pDeferred->freed.end());
+    sort(pDeferred->events.begin(), pDeferred->events.end(),
+         [](const TimingWheel::Event& a, const TimingWheel::Event& b) { return a.id < b.id; });
+
+    for (const uint32_t idx : pDeferred->spawners)
+        _pCloud->SetColumnSpawn(_boundCol[idx], true);
+    _freeSlots.insert(_freeSlots.end(), pDeferred->freed.begin(), pDeferred->freed.end());
+    for (const auto& event : pDeferred->events)
+        _wheel.Schedule(event.id, event.gen, event.dueNs);
+    pDeferred->spawners.clear();
+    pDeferred->freed.clear();
+    pDeferred->events.clear();
+}
+
+// Bring a Droplet with a due event up to date and schedule its next event
+void DropletPool::Update(size_t idx, int64_t curNs, Deferred* pDeferred) {
+    _hasMoved[idx] = 1;
+    // Positions are only brought up to date when a Droplet is visited.
+    // Integer math makes the result the same as updating every frame.
+    const uint64_t elapsedNs = static_cast<uint64_t>(max(curNs - _lastNs[idx], static_cast<int64_t>(0)));
+    const uint64_t posFx = _posFx[idx] + elapsedNs * _speedFx[idx];
+    const uint16_t charsAdvanced = static_cast<uint16_t>(min(posFx >> FX_SHIFT, static_cast<uint64_t>(0xFFFF)));
+    _posFx[idx] = posFx & (FX_ONE - 1);
+    _lastNs[idx] = curNs;
+
+    if (charsAdvanced)
+        Step(idx, charsAdvanced, curNs, pDeferred);
+    // Restart the tail after lingering. ScheduleNext() makes the end of the
+    // linger time an event, so this happens right on time.
+    if (IsLingering(idx) && curNs >= LingerEndNs(idx))
+        _isTailCrawling[idx] = 1;
+    if (_isAlive[idx])
+        ScheduleNext(idx, curNs, pDeferred);
+}
+
+high_resolution_clock::time_point DropletPool::NextEventTime() const {
+    const int64_t dueNs = _wheel.NextDueNs();
+    if (dueNs == numeric_limits<int64_t>::max())
+        return high_resolution_clock::time_point::max();
+    return high_resolution_clock::time_point(duration_cast<high_resolution_clock::duration>(nanoseconds(dueNs)));
+}
+
+void DropletPool::ScheduleAt(size_t idx, int64_t dueNs, Deferred* pDeferred) {
+    _eventGen[idx]++;
+    if (pDeferred) {
+        TimingWheel::Event event;
+        event.id = static_cast<uint32_t>(idx);
+        event.gen = _eventGen[idx];
+        event.dueNs = dueNs;
+        pDeferred->events.push_back(event);
+    } else {
+        _wheel.Schedule(static_cast<uint32_t>(idx), _eventGen[idx], dueNs);
+    }
+}
+
+// Schedule the next time this Droplet has to be visited: when it crosses the
+// next char boundary, or when its head stops being bright if that is sooner.
+// While it lingers nothing moves, so the next char boundary is replaced by the
+// end of the linger time.
+void DropletPool::ScheduleNext(size_t idx, int64_t curNs, Deferred* pDeferred) {
+    int64_t dueNs = numeric_limits<int64_t>::max();
+    const uint64_t speedFx = _speedFx[idx];
+    if (IsLingering(idx)) {
+        dueNs = LingerEndNs(idx);
+    } else if (speedFx) {
+        const uint64_t remainingFx = FX_ONE - _posFx[idx];
+        dueNs = _lastNs[idx] + static_cast<int64_t>((remainingFx + speedFx - 1) / speedFx);
+    }
+    if (!_isHeadCrawling[idx] && _headStopNs[idx] / 1000000) {
+        const int64_t brightEndNs = _headStopNs[idx] + HEAD_BRIGHT_NS;
+        if (brightEndNs > curNs)
+            dueNs = min(dueNs, brightEndNs);
+    }
+    if (dueNs == numeric_limits<int64_t>::max()) {
+        _eventGen[idx]++; // Stopped. Wait for SetCharsPerSec().
+        return;
+    }
+    ScheduleAt(idx, dueNs, pDeferred);
+}
+
+void DropletPool::Step(size_t idx, uint16_t charsAdvanced, int64_t curNs, Deferred* pDeferred) {
+    const uint16_t endLine = _endLine[idx];
 
     // Advance the head
-    if (_isHeadCrawling) {
-        _headPutLine += charsAdvanced;
-        _headPutLine = min(_headPutLine, _endLine);
+    if (_isHeadCrawling[idx]) {
+        _headPutLine[idx] += charsAdvanced;
+        _headPutLine[idx] = min(_headPutLine[idx], endLine);
 
         // If head reaches the _endLine, stop the head and maybe the tail too
-        if (_headPutLine == _endLine) {
-            _isHeadCrawling = false;
-            if (!duration_cast<milliseconds>(_headStopTime.time_since_epoch()).count()) {
-                _headStopTime = curTime;
-                if (_timeToLinger > milliseconds(0)) {
-                    _isTailCrawling = false;
+        if (_headPutLine[idx] == endLine) {
+            _isHeadCrawling[idx] = 0;
+            if (!(_headStopNs[idx] / 1000000)) {
+                _headStopNs[idx] = curNs;
+                if (_lingerMs[idx] > 0) {
+                    _isTailCrawling[idx] = 0;
                 }
             }
         }
     }
 
     // Advance the tail
-    if (_isTailCrawling && (_headPutLine >= _length || _headPutLine >= _endLine)) {
-        if (_tailPutLine != 0xFFFF) {
-            _tailPutLine += charsAdvanced;
+    const uint16_t headPutLine = _headPutLine[idx];
+    if (_isTailCrawling[idx] && (headPutLine >= _length[idx] || headPutLine >= endLine)) {
+        if (_tailPutLine[idx] != 0xFFFF) {
+            _tailPutLine[idx] += charsAdvanced;
         } else {
-            _tailPutLine = charsAdvanced;
+            _tailPutLine[idx] = charsAdvanced;
         }
-        _tailPutLine = min(_tailPutLine, _endLine);
+        _tailPutLine[idx] = min(_tailPutLine[idx], endLine);
 
         // If the tail advances far enough down the screen, allow other droplets to spawn
         const uint16_t threshLine = _pCloud->GetLines() / 4;
-        if (_tailCurLine <= threshLine && _tailPutLine > threshLine)
-            _pCloud->SetColumnSpawn(_boundCol, true);
+        if (_tailCurLine[idx] <= threshLine && _tailPutLine[idx] > threshLine) {
+            if (pDeferred)
+                pDeferred->spawners.push_back(static_cast<uint32_t>(idx));
+            else
+                _pCloud->SetColumnSpawn(_boundCol[idx], true);
+        }
     }
 
-    // Restart the tail after lingering
-    if (!_isTailCrawling && duration_cast<milliseconds>(curTime - _headStopTime) >= _timeToLinger) {
-        _isTailCrawling = true;
-    }
     // Once tail reaches the head, kill this droplet
-    if (_tailPutLine == _headPutLine) {
-        _isAlive = false;
+    if (_tailPutLine[idx] == headPutLine) {
+        Kill(idx, pDeferred);
     }
-    _lastTime = curTime; // Required or else nothing will ever get drawn...
 }
 
-void Droplet::Draw(high_resolution_clock::time_point curTime, bool drawEverything) {
+void DropletPool::Draw(size_t idx, high_resolution_clock::time_point curTime, bool drawEverything,
+                       vector<uint32_t>* pDirty) {
+    FrameBuffer* pFb = _pCloud->GetFrameBuffer();
+    const int64_t curNs = ToNs(curTime);
+    const uint16_t col = _boundCol[idx];
+    const uint16_t headPutLine = _headPutLine[idx];
+    const uint16_t tailPutLine = _tailPutLine[idx];
     uint16_t startLine = 0;
-    if (_tailPutLine != 0xFFFF) {
+    if (tailPutLine != 0xFFFF) {
         // Delete the very end of tail
-        for (uint16_t line = _tailCurLine; line <= _tailPutLine; line++) {
-            mvaddch(line, _boundCol, ' ');
+        for (uint16_t line = _tailCurLine[idx]; line <= tailPutLine; line++) {
+            pFb->Erase(line, col, pDirty);
         }
-        _tailCurLine = _tailPutLine;
-        startLine = _tailPutLine + 1;
+        _tailCurLine[idx] = tailPutLine;
+        startLine = tailPutLine + 1;
     }
-    for (uint16_t line = startLine; line <= _headPutLine; line++) {
-        const bool isGlitched = _pCloud->IsGlitched(line, _boundCol);
-        const wchar_t val = _pCloud->GetChar(line, _charPoolIdx);
-
-        CharLoc cl = CharLoc::MIDDLE;
-        if (_tailPutLine != 0xFFFF && line == _tailPutLine + 1)
-            cl = CharLoc::TAIL;
-        if (line == _headPutLine && IsHeadBright(curTime))
-            cl = CharLoc::HEAD;
-
-        // No need to draw non-glitched chars between tail and _headCurLine
-        if (cl == CharLoc::MIDDLE && line < _headCurLine && !isGlitched && line != _endLine &&
-            _pCloud->GetShadingMode() != Cloud::ShadingMode::DISTANCE_FROM_HEAD && !drawEverything)
-            continue;
+    const bool isHeadBright = IsHeadBright(idx, curNs);
+    const bool glitchedOnly = !_hasMoved[idx] && !drawEverything && _pCloud->HasGlitchIndex();
+    (this->*_drawChars)(idx, startLine, isHeadBright, drawEverything, glitchedOnly, pDirty);
+    _headCurLine[idx] = headPutLine;
+    _hasMoved[idx] = 0;
+}
 
-        Cloud::CharAttr attr;
-        _pCloud->GetAttr(line, _boundCol, val, cl, &attr, curTime, _headPutLine, _length);
+DropletPool::CharLoc DropletPool::GetCharLoc(size_t idx, uint16_t line, bool isHeadBright) const {
+    if (line == _headPutLine[idx] && isHeadBright)
+        return CharLoc::HEAD;
+    if (_tailPutLine[idx] != 0xFFFF && line == _tailPutLine[idx] + 1)
+        return CharLoc::TAIL;
+    return CharLoc::MIDDLE;
+}
 
-        attr_t attr2 = attr.isBold ? A_BOLD : A_NORMAL;
-        cchar_t wc = {};
-        wc.attr = attr2;
-        wc.chars[0] = val;
+template <unsigned BOLD, unsigned SHADING, bool GLITCHY>
+void DropletPool::DrawChars(size_t idx, uint16_t startLine, bool isHeadBright, bool drawEverything,
+                            bool glitchedOnly, vector<uint32_t>* pDirty) {
+    const uint16_t col = _boundCol[idx];
+    const uint16_t headPutLine = _headPutLine[idx];
+    if (glitchedOnly) {
+        if (!GLITCHY)
+            return;
+        const uint16_t* pRow;
+        const uint16_t* pEnd;
+        _pCloud->GetGlitchedRows(col, startLine, headPutLine, &pRow, &pEnd);
+        for (; pRow != pEnd; pRow++)
+            DrawChar<BOLD, SHADING, GLITCHY>(idx, *pRow, GetCharLoc(idx, *pRow, isHeadBright), pDirty);
+        return;
+    }
 
-        if (_pCloud->GetColorMode() != ColorMode::MONO) {
-            attron(COLOR_PAIR(attr.colorPair));
-            mvadd_wch(line, _boundCol, &wc);
-            attroff(COLOR_PAIR(attr.colorPair));
-        } else {
-            mvadd_wch(line, _boundCol, &wc);
+    const uint16_t headCurLine = _headCurLine[idx];
+    const uint16_t length = _length[idx];
+    for (uint16_t line = startLine; line <= headPutLine; line++) {
+        const CharLoc cl = GetCharLoc(idx, line, isHeadBright);
+
+        // No need to draw non-glitched chars between tail and _headCurLine,
+        // unless they are shaded by distance and their shade changed
+        if (cl == CharLoc::MIDDLE && line < headCurLine && line != _endLine[idx] &&
+            !drawEverything && !(GLITCHY && _pCloud->IsGlitched(line, col))) {
+            if (SHADING != static_cast<unsigned>(Cloud::ShadingMode::DISTANCE_FROM_HEAD))
+                continue;
+            if (_pCloud->GetShade(length, headCurLine - line) ==
+                _pCloud->GetShade(length, headPutLine - line))
+                continue;
         }
+        DrawChar<BOLD, SHADING, GLITCHY>(idx, line, cl, pDirty);
     }
-    _headCurLine = _headPutLine;
 }
 
-void Droplet::IncrementTime(milliseconds time) {
-    _lastTime += time;
-    if (duration_cast<milliseconds>(_headStopTime.time_since_epoch()).count())
-        _headStopTime += time;
+template <unsigned BOLD, unsigned SHADING, bool GLITCHY>
+void DropletPool::DrawChar(size_t idx, uint16_t line, CharLoc cl, vector<uint32_t>* pDirty) {
+    const uint16_t col = _boundCol[idx];
+    const wchar_t val = _pCloud->GetChar(line, _charPoolIdx[idx]);
+    Cloud::CharAttr attr;
+    _pCloud->GetAttr<BOLD, SHADING, GLITCHY>(line, col, val, cl, &attr, _headPutLine[idx], _length[idx]);
+    _pCloud->GetFrameBuffer()->Put(line, col, val, static_cast<uint16_t>(attr.colorPair),
+                                   attr.isBold, pDirty);
+}
+
+void DropletPool::SelectDrawPath(unsigned boldMode, unsigned shadingMode, bool glitchy) {
+    typedef Cloud::BoldMode BM;
+    typedef Cloud::ShadingMode SM;
+    constexpr unsigned OFF = static_cast<unsigned>(BM::OFF);
+    constexpr unsigned RAND = static_cast<unsigned>(BM::RANDOM);
+    constexpr unsigned ALL = static_cast<unsigned>(BM::ALL);
+    constexpr unsigned RS = static_cast<unsigned>(SM::RANDOM);
+    constexpr unsigned DH = static_cast<unsigned>(SM::DISTANCE_FROM_HEAD);
+    // Indexed by [boldMode][shadingMode][glitchy]
+    static const DrawCharsFunc drawPaths[3][2][2] = {
+        {
+            { &DropletPool::DrawChars<OFF, RS, false>, &DropletPool::DrawChars<OFF, RS, true> },
+            { &DropletPool::DrawChars<OFF, DH, false>, &DropletPool::DrawChars<OFF, DH, true> },
+        },
+        {
+            { &DropletPool::DrawChars<RAND, RS, false>, &DropletPool::DrawChars<RAND, RS, true> },
+            { &DropletPool::DrawChars<RAND, DH, false>, &DropletPool::DrawChars<RAND, DH, true> },
+        },
+        {
+            { &DropletPool::DrawChars<ALL, RS, false>, &DropletPool::DrawChars<ALL, RS, true> },
+            { &DropletPool::DrawChars<ALL, DH, false>, &DropletPool::DrawChars<ALL, DH, true> },
+        },
+    };
+    assert(boldMode < static_cast<unsigned>(BM::INVALID));
+    assert(shadingMode < static_cast<unsigned>(SM::INVALID));
+    _drawChars = drawPaths[boldMode][shadingMode][glitchy ? 1 : 0];
 }
 
-bool Droplet::IsHeadBright(high_resolution_clock::time_point curTime) const {
-    if (_isHeadCrawling)
+void DropletPool::IncrementTime(milliseconds time) {
+    const int64_t ns = duration_cast<nanoseconds>(time).count();
+    for (size_t idx = 0; idx < _isAlive.size(); idx++) {
+        if (!_isAlive[idx])
+            continue;
+        _lastNs[idx] += ns;
+        if (_headStopNs[idx] / 1000000)
+            _headStopNs[idx] += ns;
+        ScheduleNext(idx, _lastNs[idx], nullptr);
+    }
+}
+
+bool DropletPool::IsHeadBright(size_t idx, int64_t curNs) const {
+    if (_isHeadCrawling[idx])
         return true;
-    else if (duration_cast<milliseconds>(curTime - _headStopTime) <= milliseconds(100))
+    else if ((curNs - _headStopNs[idx]) / 1000000 <= 100)
         return true;
 
     return false;
 }
-
-
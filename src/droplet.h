@@ -22,32 +22,93 @@
 #ifndef DROPLET_H
 #define DROPLET_H
 
+#include "timingwheel.h"
+
 #include <chrono>
 #include <cstdint>
+#include <vector>
 
+using namespace std;
 using namespace std::chrono;
 
 class Cloud;
 
-// A Droplet is a single vertical character string
-class Droplet {
+// A Droplet is a single vertical character string. The DropletPool holds the
+// state of every Droplet as a struct of arrays, so the per-frame work can run
+// over contiguous memory. Each Droplet is identified by its index in the pool.
+//
+// Most frames, most Droplets have nothing to do. So each live Droplet has one
+// pending event in a TimingWheel for the next time it moves or its head stops
+// being bright, and Advance() only visits the Droplets whose event is due.
+class DropletPool {
 public:
-    Droplet();
-    Droplet(Cloud* cl, uint16_t col, uint16_t endLine, uint16_t cpIdx,
-            uint16_t len, float cps, milliseconds ttl);
-
-    void Reset();
-    void Activate(high_resolution_clock::time_point curTime);
-    void Advance(high_resolution_clock::time_point curTime);
-    void Draw(high_resolution_clock::time_point curTime, bool drawEverything);
+    explicit DropletPool(Cloud* pCloud) : _pCloud(pCloud) {}
+
+    // Also kills every Droplet
+    void Resize(size_t numDroplets, high_resolution_clock::time_point curTime);
+    size_t GetSize() const { return _isAlive.size(); }
+    size_t GetNumAlive() const { return _isAlive.size() - _freeSlots.size(); }
+    // Fits the live Droplets onto a resized screen. Droplets that end up
+    // entirely offscreen are killed and added to *pKilled. The others are
+    // clipped to the new last line, or follow it down if they were heading
+    // for the old one. Also grows the pool to at least numDroplets.
+    void Reshape(size_t numDroplets, uint16_t oldLines, uint16_t lines, uint16_t cols,
+                 vector<uint32_t>* pKilled);
+
+    bool HasFreeSlot() const { return !_freeSlots.empty(); }
+    // Brings a dead Droplet back to life and returns its index. Only call
+    // this when HasFreeSlot() is true.
+    size_t Spawn(uint16_t col, uint16_t endLine, uint16_t cpIdx,
+                 uint16_t len, float cps, milliseconds ttl,
+                 high_resolution_clock::time_point curTime);
+    // Moves the Droplets with due events. If visitAll is true, every live
+    // Droplet is returned by GetVisited() whether it had an event or not.
+    // Otherwise the live Droplets in alsoVisit are returned as well.
+    void Advance(high_resolution_clock::time_point curTime, bool visitAll,
+                 const vector<uint32_t>& alsoVisit);
+
+    // Changes to shared state made while advancing Droplets on a worker
+    // thread. ApplyDeferred() makes them once all the threads are done.
+    struct Deferred {
+        vector<uint32_t> spawners = {}; // Droplets whose column can spawn again
+        vector<uint32_t> freed = {}; // Droplets that died
+        vector<TimingWheel::Event> events = {}; // Events to schedule
+    };
+    // Advance() split up for multithreading. CollectDue() runs on one thread.
+    // Then AdvanceDue() can run on several threads at once, as long as each
+    // visited Droplet is handled by exactly one of them.
+    void CollectDue(high_resolution_clock::time_point curTime, bool visitAll,
+                    const vector<uint32_t>& alsoVisit);
+    void AdvanceDue(size_t idx, high_resolution_clock::time_point curTime, Deferred* pDeferred);
+    // Moves the changes of *pFrom to the end of *pInto
+    static void MergeDeferred(Deferred* pFrom, Deferred* pInto);
+    // Makes the changes in Droplet index order, which is the order Advance()
+    // makes them in, so that threading does not change the simulation. Also
+    // clears *pDeferred.
+    void ApplyDeferred(Deferred* pDeferred);
+    // The Droplets that need to be drawn after Advance(), in index order.
+    // Droplets that died during Advance() are included to erase their tail.
+    const vector<uint32_t>& GetVisited() const { return _visited; }
+    // The earliest time that Advance() might have something to do
+    high_resolution_clock::time_point NextEventTime() const;
+    // Droplets that were visited without moving only redraw their glitched
+    // chars, unless drawEverything is true. Dirty cells go to pDirty if given
+    // (see FrameBuffer::Put()).
+    void Draw(size_t idx, high_resolution_clock::time_point curTime, bool drawEverything,
+              vector<uint32_t>* pDirty = nullptr);
+    // Cloud calls this whenever its bold mode, shading mode, or glitchiness
+    // changes. The arguments are the underlying values of Cloud::BoldMode and
+    // Cloud::ShadingMode.
+    void SelectDrawPath(unsigned boldMode, unsigned shadingMode, bool glitchy);
 
     // Getters/Setters/Convenience
-    bool IsAlive() const { return _isAlive; }
-    uint16_t GetCol() const { return _boundCol; }
-    void SetCharsPerSec(float cps) { _charsPerSec = cps; }
-    uint16_t GetHeadPutLine() const { return _headPutLine; }
-    uint16_t GetTailPutLine() const { return _tailPutLine; }
-    uint16_t GetCharPoolIdx() const { return _charPoolIdx; }
+    bool IsAlive(size_t idx) const { return _isAlive[idx]; }
+    bool HasMoved(size_t idx) const { return _hasMoved[idx]; } // Since the last Draw()
+    uint16_t GetCol(size_t idx) const { return _boundCol[idx]; }
+    void SetCharsPerSec(size_t idx, float cps);
+    uint16_t GetHeadPutLine(size_t idx) const { return _headPutLine[idx]; }
+    uint16_t GetTailPutLine(size_t idx) const { return _tailPutLine[idx]; }
+    uint16_t GetCharPoolIdx(size_t idx) const { return _charPoolIdx[idx]; }
     void IncrementTime(milliseconds time); // To facilitate pausing
 
     enum class CharLoc { // describes where a char is within a Droplet
@@ -58,23 +119,71 @@ public:
 
 private:
     Cloud* _pCloud; // Cloud keeps track of attributes/characters
-    bool _isAlive; // Is this Droplet still displaying something?
-    bool _isHeadCrawling; // Is the head (bottom) still moving?
-    bool _isTailCrawling; // Is the tail (top) still moving?
-    uint16_t _boundCol; // Which screen column this droplet renders to
-    uint16_t _headPutLine; // Where we are advancing the head
-    uint16_t _headCurLine; // Where the head currently is
-    uint16_t _tailPutLine; // Where we are advancing the tail
-    uint16_t _tailCurLine; // The last empty line in this column
-    uint16_t _endLine; // The head will not advance past this line
-    uint16_t _charPoolIdx; // Index into the "charPool"
-    uint16_t _length; // How many chars is this droplet?
-    float _charsPerSec; // How many chars will be drawn per second
-    high_resolution_clock::time_point _lastTime; // Last time we drew something
-    high_resolution_clock::time_point _headStopTime; // Time when head stopped
-    milliseconds _timeToLinger; // How long the droplet is stationary before destruction
-
-    bool IsHeadBright(high_resolution_clock::time_point curTime) const;
+
+    // Times are in nanoseconds since the clock's epoch
+    vector<uint8_t> _isAlive = {}; // Is this Droplet still displaying something?
+    vector<uint8_t> _isHeadCrawling = {}; // Is the head (bottom) still moving?
+    vector<uint8_t> _isTailCrawling = {}; // Is the tail (top) still moving?
+    vector<uint16_t> _boundCol = {}; // Which screen column this droplet renders to
+    vector<uint16_t> _headPutLine = {}; // Where we are advancing the head
+    vector<uint16_t> _headCurLine = {}; // Where the head currently is
+    vector<uint16_t> _tailPutLine = {}; // Where we are advancing the tail
+    vector<uint16_t> _tailCurLine = {}; // The last empty line in this column
+    vector<uint16_t> _endLine = {}; // The head will not advance past this line
+    vector<uint16_t> _charPoolIdx = {}; // Index into the "charPool"
+    vector<uint16_t> _length = {}; // How many chars is this droplet?
+    vector<uint64_t> _speedFx = {}; // Chars per nanosecond (fixed-point)
+    vector<uint64_t> _posFx = {}; // Progress towards the next char (fixed-point)
+    vector<int64_t> _lastNs = {}; // Last time _posFx was brought up to date
+    vector<int64_t> _headStopNs = {}; // Time when head stopped (0 if still moving)
+    vector<int64_t> _lingerMs = {}; // How long the droplet is stationary before destruction
+    vector<uint32_t> _eventGen = {}; // Generation of the pending event
+    vector<uint8_t> _isDue = {}; // Set by CollectDue() for AdvanceDue()
+    vector<uint8_t> _hasMoved = {}; // Changed since the last Draw()?
+    vector<uint32_t> _freeSlots = {}; // Stack of dead Droplets
+    TimingWheel _wheel = {};
+    vector<TimingWheel::Event> _due = {}; // Scratch space for Advance()
+    vector<uint32_t> _visited = {};
+
+    // Speeds and positions are fixed-point numbers with FX_SHIFT fraction
+    // bits. Progress accumulates in whole nanoseconds, so droplets move the
+    // same way no matter how the elapsed time is split up into frames.
+    static constexpr int FX_SHIFT = 40;
+    static constexpr uint64_t FX_ONE = static_cast<uint64_t>(1) << FX_SHIFT;
+    static uint64_t CharsPerSecToFx(float cps);
+    // The head is bright while it moves and for 100ms after it stops
+    static constexpr int64_t HEAD_BRIGHT_NS = 101000000;
+
+    void Grow(size_t numDroplets); // Adds dead Droplets
+    // Puts _visited in index order with the Droplets of alsoVisit added
+    void FinishVisited(bool visitAll, const vector<uint32_t>& alsoVisit);
+
+    // These change shared state. When pDeferred is not null, the changes are
+    // recorded there instead.
+    void Update(size_t idx, int64_t curNs, Deferred* pDeferred);
+    void Kill(size_t idx, Deferred* pDeferred);
+    void Step(size_t idx, uint16_t charsAdvanced, int64_t curNs, Deferred* pDeferred);
+    void ScheduleAt(size_t idx, int64_t dueNs, Deferred* pDeferred);
+    void ScheduleNext(size_t idx, int64_t curNs, Deferred* pDeferred);
+    bool IsHeadBright(size_t idx, int64_t curNs) const;
+    // The head has stopped and the tail waits for _lingerMs before following
+    bool IsLingering(size_t idx) const { return !_isHeadCrawling[idx] && !_isTailCrawling[idx]; }
+    int64_t LingerEndNs(size_t idx) const { return _headStopNs[idx] + _lingerMs[idx] * 1000000; }
+
+    // Draw() checks the display modes once per Droplet rather than once per
+    // char. DrawChars() is compiled separately for every combination of
+    // modes, and SelectDrawPath() points _drawChars at the right one.
+    // If glitchedOnly is true, only the glitched chars are drawn.
+    typedef void (DropletPool::*DrawCharsFunc)(size_t idx, uint16_t startLine, bool isHeadBright,
+                                                bool drawEverything, bool glitchedOnly,
+                                                vector<uint32_t>* pDirty);
+    template <unsigned BOLD, unsigned SHADING, bool GLITCHY>
+    void DrawChars(size_t idx, uint16_t startLine, bool isHeadBright, bool drawEverything,
+                   bool glitchedOnly, vector<uint32_t>* pDirty);
+    template <unsigned BOLD, unsigned SHADING, bool GLITCHY>
+    void DrawChar(size_t idx, uint16_t line, CharLoc cl, vector<uint32_t>* pDirty);
+    CharLoc GetCharLoc(size_t idx, uint16_t line, bool isHeadBright) const;
+    DrawCharsFunc _drawChars = nullptr;
 };
 
 #endif
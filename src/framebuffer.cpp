@@ -0,0 +1,168 @@
+/*
+    framebuffer.cpp - Implements the FrameBuffer class
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "framebuffer.h"
+
+#include <algorithm>
+#include <cassert>
+#include <utility>
+
+void FrameBuffer::Resize(uint16_t lines, uint16_t cols) {
+    _lines = lines;
+    _cols = cols;
+    const size_t screenSize = static_cast<size_t>(_lines) * _cols;
+    _back.resize(screenSize);
+    _front.resize(screenSize);
+    _isDirty.resize(screenSize);
+    _dirty.reserve(screenSize);
+    Clear();
+}
+
+void FrameBuffer::Clear() {
+    _overlayLines = 0;
+    _overlayCols = 0;
+    const Cell blank;
+    for (auto& cell : _back)
+        cell = blank;
+    for (auto& cell : _front)
+        cell = blank;
+    for (auto& flag : _isDirty)
+        flag = 0;
+    _dirty.clear();
+    _needsClear = true;
+}
+
+void FrameBuffer::Put(uint16_t line, uint16_t col, wchar_t val, uint16_t color, bool isBold,
+                      vector<uint32_t>* pDirty) {
+    assert(line < _lines && col < _cols);
+    const uint32_t idx = static_cast<uint32_t>(line) * _cols + col;
+    Cell& cell = _back[idx];
+    cell.val = val;
+    cell.color = color;
+    cell.isBold = isBold;
+    MarkDirty(idx, pDirty);
+}
+
+void FrameBuffer::Repaint() {
+    const Cell blank;
+    const uint32_t screenSize = static_cast<uint32_t>(_back.size());
+    for (uint32_t idx = 0; idx < screenSize; idx++) {
+        _front[idx] = blank;
+        if (GetCell(idx) != blank)
+            MarkDirty(idx);
+    }
+    _needsClear = true;
+}
+
+void FrameBuffer::SetOverlay(uint16_t line, uint16_t col, uint16_t lines, uint16_t cols) {
+    assert(line + lines <= _lines && col + cols <= _cols);
+    MarkOverlayDirty(); // The old box
+    _overlayLine = line;
+    _overlayCol = col;
+    _overlayLines = lines;
+    _overlayCols = cols;
+    _overlay.assign(static_cast<size_t>(lines) * cols, Cell());
+    MarkOverlayDirty();
+}
+
+void FrameBuffer::PutOverlay(uint16_t line, uint16_t col, wchar_t val, uint16_t color, bool isBold) {
+    assert(line < _overlayLines && col < _overlayCols);
+    Cell& cell = _overlay[static_cast<size_t>(line) * _overlayCols + col];
+    if (cell.val == val && cell.color == color && cell.isBold == isBold)
+        return;
+    cell.val = val;
+    cell.color = color;
+    cell.isBold = isBold;
+    MarkDirty(static_cast<uint32_t>(_overlayLine + line) * _cols + _overlayCol + col);
+}
+
+void FrameBuffer::RemoveOverlay() {
+    MarkOverlayDirty();
+    _overlayLines = 0;
+    _overlayCols = 0;
+}
+
+void FrameBuffer::MarkOverlayDirty() {
+    for (uint32_t line = _overlayLine; line < _overlayLine + _overlayLines; line++) {
+        for (uint32_t col = _overlayCol; col < _overlayCol + _overlayCols; col++)
+            MarkDirty(line * _cols + col);
+    }
+}
+
+void FrameBuffer::SetPalette(Palette&& palette) {
+    const bool sameRamp = !palette.ramp.empty() &&
+        palette.ramp.size() == _palette.ramp.size() &&
+        palette.bg == _palette.bg && palette.defaultBg == _palette.defaultBg;
+    if (sameRamp) {
+        // Only rewrite the cells whose RGB value actually changes
+        const uint32_t screenSize = static_cast<uint32_t>(_front.size());
+        for (uint32_t idx = 0; idx < screenSize; idx++) {
+            const uint16_t color = _front[idx].color;
+            if (color && color < _palette.ramp.size() &&
+                palette.ramp[color] != _palette.ramp[color]) {
+                _front[idx].color = 0xFFFF; // Make IsStale() true
+                MarkDirty(idx);
+            }
+        }
+    } else {
+        Repaint();
+    }
+    _palette = std::move(palette);
+    _paletteChanged = true;
+}
+
+Rgb ColorNumToRgb(short color) {
+    static const uint8_t systemColors[16][3] = {
+        {0, 0, 0}, {205, 0, 0}, {0, 205, 0}, {205, 205, 0},
+        {0, 0, 238}, {205, 0, 205}, {0, 205, 205}, {229, 229, 229},
+        {127, 127, 127}, {255, 0, 0}, {0, 255, 0}, {255, 255, 0},
+        {92, 92, 255}, {255, 0, 255}, {0, 255, 255}, {255, 255, 255},
+    };
+    static const uint8_t cubeLevels[6] = { 0, 95, 135, 175, 215, 255 };
+
+    Rgb rgb;
+    if (color < 0) {
+        return rgb;
+    } else if (color < 16) {
+        rgb.r = systemColors[color][0];
+        rgb.g = systemColors[color][1];
+        rgb.b = systemColors[color][2];
+    } else if (color < 232) {
+        const int cubeIdx = color - 16;
+        rgb.r = cubeLevels[cubeIdx / 36];
+        rgb.g = cubeLevels[(cubeIdx / 6) % 6];
+        rgb.b = cubeLevels[cubeIdx % 6];
+    } else {
+        const uint8_t gray = static_cast<uint8_t>(8 + 10 * (min(color, static_cast<short>(255)) - 232));
+        rgb.r = gray;
+        rgb.g = gray;
+        rgb.b = gray;
+    }
+    return rgb;
+}
+
+void FrameBuffer::Commit() {
+    for (const uint32_t idx : _dirty) {
+        _front[idx] = GetCell(idx);
+        _isDirty[idx] = 0;
+    }
+    _dirty.clear();
+    _needsClear = false;
+    _paletteChanged = false;
+}
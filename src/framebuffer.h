@@ -0,0 +1,151 @@
+/*
+    framebuffer.h
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "neo.h"
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// A single character cell as it should appear onscreen
+struct Cell {
+    wchar_t val = L' ';
+    uint16_t color = 0; // Palette index (0 means "background only")
+    bool isBold = false;
+
+    bool operator==(const Cell& rhs) const {
+        return val == rhs.val && color == rhs.color && isBold == rhs.isBold;
+    }
+    bool operator!=(const Cell& rhs) const { return !(*this == rhs); }
+};
+
+struct ColorPair {
+    short fg = 0;
+    short bg = 0;
+};
+
+struct Rgb {
+    uint8_t r = 0;
+    uint8_t g = 0;
+    uint8_t b = 0;
+
+    bool operator==(const Rgb& rhs) const { return r == rhs.r && g == rhs.g && b == rhs.b; }
+    bool operator!=(const Rgb& rhs) const { return !(*this == rhs); }
+};
+
+// Maps the palette indices stored in each Cell to terminal colors
+struct Palette {
+    vector<ColorContent> colors = {}; // Colors to redefine (TRUECOLOR only)
+    vector<ColorPair> pairs = {}; // Indexed by palette index. [0] is unused.
+    vector<Rgb> ramp = {}; // DIRECT only: RGB for each palette index. [0] is unused.
+    Rgb bg = {}; // DIRECT only: the background color
+    bool defaultBg = false; // DIRECT only: use the terminal's background color
+};
+
+// Look up the RGB value that xterm uses for one of the 256 indexed colors
+Rgb ColorNumToRgb(short color);
+
+// The FrameBuffer is a renderer-neutral copy of the screen. Cloud draws into
+// the "back" cells and a Backend later pushes the cells that changed since
+// the last flush to the terminal. The "front" cells mirror what the Backend
+// last wrote, so redrawing a cell with the same contents costs nothing.
+class FrameBuffer {
+public:
+    void Resize(uint16_t lines, uint16_t cols);
+    void Clear(); // Blank every cell and make the Backend clear the terminal
+    void Repaint(); // Make the Backend clear the terminal and rewrite every cell
+
+    // Cells are added to pDirty instead of the FrameBuffer's own dirty list if
+    // it is given. This lets several threads draw into separate columns at
+    // once. The lists must be passed to AddDirty() before the next flush.
+    void Put(uint16_t line, uint16_t col, wchar_t val, uint16_t color, bool isBold,
+             vector<uint32_t>* pDirty = nullptr);
+    void Erase(uint16_t line, uint16_t col, vector<uint32_t>* pDirty = nullptr) {
+        Put(line, col, L' ', 0, false, pDirty);
+    }
+    void AddDirty(const vector<uint32_t>& dirty) {
+        _dirty.insert(_dirty.end(), dirty.begin(), dirty.end());
+    }
+    const Cell& Get(uint16_t line, uint16_t col) const { // Ignores the overlay
+        return _back[static_cast<size_t>(line) * _cols + col];
+    }
+
+    // The overlay is a box that is shown on top of the other cells without
+    // changing them, so removing it brings back whatever is underneath
+    // without redrawing anything. Resize() and Clear() remove it.
+    void SetOverlay(uint16_t line, uint16_t col, uint16_t lines, uint16_t cols); // Blank
+    void PutOverlay(uint16_t line, uint16_t col, wchar_t val, uint16_t color, bool isBold); // Relative to the box
+    void RemoveOverlay();
+    bool HasOverlay() const { return _overlayLines != 0; }
+
+    uint16_t GetLines() const { return _lines; }
+    uint16_t GetCols() const { return _cols; }
+
+    void SetPalette(Palette&& palette);
+    const Palette& GetPalette() const { return _palette; }
+
+    // Used by the Backend while flushing
+    const vector<uint32_t>& GetDirty() const { return _dirty; }
+    const Cell& GetCell(uint32_t idx) const { // Includes the overlay
+        if (_overlayLines) {
+            const uint32_t line = idx / _cols - _overlayLine;
+            const uint32_t col = idx % _cols - _overlayCol;
+            if (line < _overlayLines && col < _overlayCols)
+                return _overlay[line * _overlayCols + col];
+        }
+        return _back[idx];
+    }
+    bool IsStale(uint32_t idx) const { return GetCell(idx) != _front[idx]; }
+    bool NeedsClear() const { return _needsClear; }
+    bool PaletteChanged() const { return _paletteChanged; }
+    void Commit(); // Call after the dirty cells have been written out
+
+private:
+    uint16_t _lines = 0;
+    uint16_t _cols = 0;
+    vector<Cell> _back = {}; // What the screen should look like (row-major)
+    vector<Cell> _front = {}; // What the Backend last wrote
+    vector<uint8_t> _isDirty = {}; // 1 if the cell is already in _dirty
+    vector<uint32_t> _dirty = {}; // Cells written since the last Commit()
+    bool _needsClear = true;
+    bool _paletteChanged = false;
+    Palette _palette = {};
+    uint16_t _overlayLine = 0;
+    uint16_t _overlayCol = 0;
+    uint16_t _overlayLines = 0; // 0 if there is no overlay
+    uint16_t _overlayCols = 0;
+    vector<Cell> _overlay = {};
+
+    void MarkOverlayDirty();
+
+    void MarkDirty(uint32_t idx, vector<uint32_t>* pDirty = nullptr) {
+        if (!_isDirty[idx]) {
+            _isDirty[idx] = 1;
+            (pDirty ? pDirty : &_dirty)->push_back(idx);
+        }
+    }
+};
+
+#endif
@@ -0,0 +1,110 @@
+/*
+    hud.cpp - Implements the Hud class
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "hud.h"
+
+#include <cstdio>
+#include <cstring>
+
+constexpr milliseconds Hud::UPDATE_PERIOD;
+constexpr uint16_t Hud::LINES;
+constexpr uint16_t Hud::COLS;
+
+void Hud::Toggle(FrameBuffer* pFb, high_resolution_clock::time_point curTime) {
+    _isVisible = !_isVisible;
+    if (_isVisible) {
+        _frameTimes.Clear();
+        _periodCells = 0;
+        _periodBytes = 0;
+        _periodStart = curTime;
+        _fps = 0.0;
+        _p50Ns = 0;
+        _p99Ns = 0;
+        _cellsPerFrame = 0.0;
+        _bytesPerFrame = 0.0;
+        _isChanged = true;
+    } else {
+        pFb->RemoveOverlay();
+    }
+}
+
+void Hud::RecordFrame(high_resolution_clock::time_point curTime, nanoseconds frameTime,
+                      size_t cellsWritten, size_t bytesWritten) {
+    if (!_isVisible)
+        return;
+    _frameTimes.Record(static_cast<uint64_t>(frameTime.count()));
+    _periodCells += cellsWritten;
+    _periodBytes += bytesWritten;
+    if (curTime < NextUpdateTime())
+        return;
+
+    const double periodSec = duration_cast<nanoseconds>(curTime - _periodStart).count() / 1.0e9;
+    const uint64_t numFrames = _frameTimes.GetCount();
+    _fps = numFrames / periodSec;
+    _p50Ns = _frameTimes.GetPercentile(50.0);
+    _p99Ns = _frameTimes.GetPercentile(99.0);
+    _cellsPerFrame = static_cast<double>(_periodCells) / numFrames;
+    _bytesPerFrame = static_cast<double>(_periodBytes) / numFrames;
+    _frameTimes.Clear();
+    _periodCells = 0;
+    _periodBytes = 0;
+    _periodStart = curTime;
+    _isChanged = true;
+}
+
+void Hud::Draw(FrameBuffer* pFb, size_t liveDroplets, size_t numDroplets, uint16_t color) {
+    if (!_isVisible)
+        return;
+    if (pFb->HasOverlay() && !_isChanged)
+        return;
+    if (pFb->GetLines() < LINES || pFb->GetCols() < COLS)
+        return; // Try again after the next resize
+    if (!pFb->HasOverlay())
+        pFb->SetOverlay(0, 0, LINES, COLS);
+
+    char value[32];
+    snprintf(value, sizeof(value), "%.1f", _fps);
+    PutLine(pFb, 0, "fps", value, color);
+    snprintf(value, sizeof(value), "%.1f us", _p50Ns / 1000.0);
+    PutLine(pFb, 1, "p50", value, color);
+    snprintf(value, sizeof(value), "%.1f us", _p99Ns / 1000.0);
+    PutLine(pFb, 2, "p99", value, color);
+    snprintf(value, sizeof(value), "%zu/%zu", liveDroplets, numDroplets);
+    PutLine(pFb, 3, "droplets", value, color);
+    snprintf(value, sizeof(value), "%.0f", _cellsPerFrame);
+    PutLine(pFb, 4, "cells/fr", value, color);
+    if (_bytesPerFrame == 0.0 && _cellsPerFrame > 0.0)
+        snprintf(value, sizeof(value), "?"); // The Backend cannot tell
+    else
+        snprintf(value, sizeof(value), "%.0f", _bytesPerFrame);
+    PutLine(pFb, 5, "bytes/fr", value, color);
+    _isChanged = false;
+}
+
+// Writes " label      value " across the whole width of the box
+void Hud::PutLine(FrameBuffer* pFb, uint16_t line, const char* label, const char* value,
+                  uint16_t color) {
+    char text[COLS + 1];
+    snprintf(text, sizeof(text), " %-*s%*s ", 8, label, COLS - 10, value);
+    const size_t len = strlen(text);
+    for (uint16_t col = 0; col < COLS; col++) {
+        const wchar_t val = col < len ? static_cast<wchar_t>(text[col]) : L' ';
+        pFb->PutOverlay(line, col, val, color, col < 9);
+    }
+}
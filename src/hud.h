@@ -0,0 +1,73 @@
+/*
+    hud.h
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef HUD_H
+#define HUD_H
+
+#include "framebuffer.h"
+#include "profiler.h"
+
+#include <chrono>
+#include <cstdint>
+
+using namespace std;
+using namespace std::chrono;
+
+// A box of performance stats in the top left corner, toggled with the 'F'
+// key. It is shown in the FrameBuffer's overlay, so showing or hiding it does
+// not make the Droplets underneath redraw. The stats are only collected while
+// it is visible, and the numbers onscreen change every UPDATE_PERIOD.
+class Hud {
+public:
+    void Toggle(FrameBuffer* pFb, high_resolution_clock::time_point curTime);
+    bool IsVisible() const { return _isVisible; }
+    // Call after each frame is flushed with the frame's Backend stats.
+    // frameTime should not include any time spent waiting for the next frame.
+    void RecordFrame(high_resolution_clock::time_point curTime, nanoseconds frameTime,
+                     size_t cellsWritten, size_t bytesWritten);
+    // When the numbers onscreen will next change
+    high_resolution_clock::time_point NextUpdateTime() const { return _periodStart + UPDATE_PERIOD; }
+    // Puts the latest numbers into the overlay. Call before each flush.
+    void Draw(FrameBuffer* pFb, size_t liveDroplets, size_t numDroplets, uint16_t color);
+
+private:
+    static constexpr milliseconds UPDATE_PERIOD = milliseconds(500);
+    static constexpr uint16_t LINES = 6;
+    static constexpr uint16_t COLS = 22;
+
+    bool _isVisible = false;
+    bool _isChanged = false; // The numbers onscreen are out of date
+    high_resolution_clock::time_point _periodStart = {};
+    Histogram _frameTimes = {}; // This period's frames
+    uint64_t _periodCells = 0;
+    uint64_t _periodBytes = 0;
+
+    // The numbers onscreen
+    double _fps = 0.0;
+    uint64_t _p50Ns = 0;
+    uint64_t _p99Ns = 0;
+    double _cellsPerFrame = 0.0;
+    double _bytesPerFrame = 0.0;
+
+    void PutLine(FrameBuffer* pFb, uint16_t line, const char* label, const char* value, uint16_t color);
+};
+
+#endif
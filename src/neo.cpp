@@ -18,19 +18,30 @@
 */
 
 #include "neo.h"
+#include "backend.h"
 #include "droplet.h"
 #include "cloud.h"
+#include "hud.h"
+#include "profiler.h"
+#include "trace.h"
 
 #include <getopt.h>
 #include <locale.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/select.h>
+#include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <climits>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <memory>
 #include <random>
-#include <thread>
+#include <string>
 #include <utility>
+#include <unistd.h>
 
 #ifdef __APPLE__
     #define _XOPEN_SOURCE_EXTENDED 1
@@ -56,13 +67,16 @@ void Die(const char* fmtStr, ...) {
 
 static bool cursesInit = false;
 static bool screensaver = false;
+static unique_ptr<Backend> activeBackend;
+static Hud hud;
 
 ColorContent ParseColorLine(char* line, size_t lineNum) {
     ColorContent cc;
     cc.color = static_cast<short>(strtol(line, nullptr, 10));
-    if (cc.color >= COLORS) {
+    const int numColors = cursesInit ? COLORS : 256;
+    if (cc.color >= numColors) {
         Die("Bad color value (%d) on line %zu (max %d)\n",
-            cc.color, lineNum, COLORS-1);
+            cc.color, lineNum, numColors-1);
     }
     if (!strstr(line, ",")) {
         // No commas found - the user provided a single 16 or 256 color value.
@@ -170,8 +184,9 @@ vector<ColorContent> ParseColorFile(const char* filename) {
             continue;
         }
         numColorPairs++;
-        if (numColorPairs > static_cast<size_t>(COLOR_PAIRS))
-            Die("Color file has too many lines (max %d)\n", COLOR_PAIRS);
+        const int maxPairs = cursesInit ? COLOR_PAIRS : 256;
+        if (numColorPairs > static_cast<size_t>(maxPairs))
+            Die("Color file has too many lines (max %d)\n", maxPairs);
 
         ColorContent cc = ParseColorLine(line, numLines);
         colors.push_back(cc);
@@ -184,6 +199,26 @@ vector<ColorContent> ParseColorFile(const char* filename) {
     return colors;
 }
 
+// Read a whole file for --messagefile. Trailing newlines and carriage returns
+// are dropped.
+string ReadMessageFile(const char* filename) {
+    FILE* msgFile = fopen(filename, "r");
+    if (!msgFile)
+        Die("Could not read messagefile: %s\n", filename);
+
+    string msg;
+    char buf[4096];
+    size_t numRead;
+    while ((numRead = fread(buf, 1, sizeof(buf), msgFile)) > 0)
+        msg.append(buf, numRead);
+    fclose(msgFile);
+
+    msg.erase(remove(msg.begin(), msg.end(), '\r'), msg.end());
+    while (!msg.empty() && msg.back() == '\n')
+        msg.pop_back();
+    return msg;
+}
+
 // Determine the correct ColorMode to use based on user input and
 // the color capabilities that ncurses advertises.
 ColorMode PickColorMode(ColorMode usrColorMode) {
@@ -228,22 +263,31 @@ int InitCurses(ColorMode usrColorMode, ColorMode* pOutColorMode) {
 }
 
 void Cleanup() {
+    if (activeBackend) {
+        activeBackend->Close();
+        activeBackend.reset();
+    }
     if (cursesInit) {
         endwin();
     }
     cursesInit = false;
 }
 
-void HandleInput(Cloud* pCloud) {
+// Returns true if a key was read
+bool HandleInput(Cloud* pCloud) {
+    TRACE_SCOPE("input");
     int ch = getch();
     if (ch == -1)
-        return;
+        return false;
     if (screensaver && ch != KEY_RESIZE) {
         Cleanup();
         exit(0);
     }
     switch (ch) {
         case KEY_RESIZE:
+            pCloud->Resize();
+            pCloud->ForceDrawEverything();
+            break;
         case ' ':
             pCloud->Reset();
             pCloud->ForceDrawEverything();
@@ -256,6 +300,9 @@ void HandleInput(Cloud* pCloud) {
         case 'p':
             pCloud->TogglePause();
             break;
+        case 'F':
+            hud.Toggle(pCloud->GetFrameBuffer(), high_resolution_clock::now());
+            break;
         case KEY_UP: {
             float cps = pCloud->GetCharsPerSec();
             if (cps <= 0.5f)
@@ -366,6 +413,7 @@ void HandleInput(Cloud* pCloud) {
         default:
             break;
     }
+    return true;
 }
 
 void PrintVersion() {
@@ -410,12 +458,26 @@ void PrintHelp(bool bErr, const char* appName) {
     fprintf(f, "  -S, --speed=NUM        set the scroll speed in chars per second\n");
     fprintf(f, "  -s, --screensaver      exit on the first key press\n");
     fprintf(f, "  -V, --version          print the version\n");
+    fprintf(f, "      --attrlayout=STR   store cell attributes by rows or cols\n");
+    fprintf(f, "      --backend=STR      select how the screen is drawn (ncurses or vt)\n");
     fprintf(f, "      --chars=NUM1,2     use a range of unicode chars\n");
     fprintf(f, "      --charset=STR      set the character set\n");
     fprintf(f, "      --colormode=NUM    set the color mode\n");
+    fprintf(f, "      --frames=NUM       exit after drawing NUM frames\n");
+    fprintf(f, "      --glitchgroups=NUM glitch NUM groups of columns at different times\n");
+    fprintf(f, "      --hashattrs        derive cell colors and glitches from a hash\n");
+    fprintf(f, "      --headless         simulate without a terminal and print stats\n");
     fprintf(f, "      --maxdpc=NUM       set the maximum droplets per column\n");
+    fprintf(f, "      --messagefile=FILE display a message read from a file\n");
     fprintf(f, "      --noglitch         disable character glitching\n");
+    fprintf(f, "      --perfcounters     profile and also count CPU events per stage (Linux)\n");
+    fprintf(f, "      --profilejson=FILE profile and also write the results to FILE as JSON\n");
+    fprintf(f, "      --seed=NUM         seed the random number generators\n");
     fprintf(f, "      --shortpct=NUM     set the percentage of shortened droplets\n");
+    fprintf(f, "      --size=WxH         set the screen size for --headless\n");
+    fprintf(f, "      --threads=NUM      simulate using NUM threads\n");
+    fprintf(f, "      --trace=FILE       write a Chrome trace of every frame to FILE\n");
+    fprintf(f, "      --virtualclock     advance time by exactly one frame period per frame\n");
     fprintf(f, "\n");
     fprintf(f, "See the manual page for more info: man neo\n");
     exit(bErr ? 1 : 0);
@@ -423,16 +485,32 @@ void PrintHelp(bool bErr, const char* appName) {
 
 // Long form options that have no short equivalent
 enum LongOpts {
-    CHARS = CHAR_MAX + 1,
+    ATTRLAYOUT = CHAR_MAX + 1,
+    BACKEND,
+    CHARS,
     CHARSET,
     COLORMODE,
+    FRAMES,
+    GLITCHGROUPS,
+    HASHATTRS,
+    HEADLESS,
     MAXDPC,
+    MESSAGEFILE,
     NOGLITCH,
+    PERFCOUNTERS,
+    PROFILEJSON,
+    SEED,
     SHORTPCT,
+    SIZE,
+    THREADS,
+    TRACE,
+    VIRTUALCLOCK,
 };
 
 static constexpr option long_options[] = {
     { "async",       no_argument,       nullptr, 'a' },
+    { "attrlayout",  required_argument, nullptr, LongOpts::ATTRLAYOUT },
+    { "backend",     required_argument, nullptr, LongOpts::BACKEND },
     { "bold",        required_argument, nullptr, 'b' },
     { "chars",       required_argument, nullptr, LongOpts::CHARS },
     { "charset",     required_argument, nullptr, LongOpts::CHARSET },
@@ -442,44 +520,110 @@ static constexpr option long_options[] = {
     { "defaultbg",   no_argument,       nullptr, 'D' },
     { "density",     required_argument, nullptr, 'd' },
     { "fps",         required_argument, nullptr, 'f' },
+    { "frames",      required_argument, nullptr, LongOpts::FRAMES },
     { "fullwidth",   no_argument,       nullptr, 'F' },
+    { "glitchgroups", required_argument, nullptr, LongOpts::GLITCHGROUPS },
     { "glitchms",    required_argument, nullptr, 'g' },
     { "glitchpct",   required_argument, nullptr, 'G' },
+    { "hashattrs",   no_argument,       nullptr, LongOpts::HASHATTRS },
+    { "headless",    no_argument,       nullptr, LongOpts::HEADLESS },
     { "help",        no_argument,       nullptr, 'h' },
     { "lingerms",    required_argument, nullptr, 'l' },
     { "maxdpc",      required_argument, nullptr, LongOpts::MAXDPC },
     { "message",     required_argument, nullptr, 'm' },
+    { "messagefile", required_argument, nullptr, LongOpts::MESSAGEFILE },
     { "noglitch",    no_argument,       nullptr, LongOpts::NOGLITCH },
+    { "perfcounters", no_argument,      nullptr, LongOpts::PERFCOUNTERS },
     { "screensaver", no_argument,       nullptr, 's' },
+    { "seed",        required_argument, nullptr, LongOpts::SEED },
     { "shadingmode", required_argument, nullptr, 'M' },
     { "profile",     no_argument,       nullptr, 'p' },
+    { "profilejson", required_argument, nullptr, LongOpts::PROFILEJSON },
     { "rippct",      required_argument, nullptr, 'r' },
     { "shortpct",    required_argument, nullptr, LongOpts::SHORTPCT },
+    { "size",        required_argument, nullptr, LongOpts::SIZE },
     { "speed",       required_argument, nullptr, 'S' },
+    { "threads",     required_argument, nullptr, LongOpts::THREADS },
+    { "trace",       required_argument, nullptr, LongOpts::TRACE },
     { "version",     no_argument,       nullptr, 'V' },
+    { "virtualclock", no_argument,      nullptr, LongOpts::VIRTUALCLOCK },
     { nullptr,       no_argument,       nullptr, 0 }
 };
 
 const char* optstring = "A:ab:C:c:Dd:Ff:G:g:hl:M:m:pr:sS:V";
 
+// Options that must be known before ncurses is initialized
+struct EarlyOpts {
+    ColorMode colorMode = ColorMode::INVALID;
+    BackendType backendType = BackendType::NCURSES;
+    bool headless = false;
+    uint16_t lines = 25; // Only used by headless mode
+    uint16_t cols = 80; // Only used by headless mode
+    const char* tracePath = nullptr;
+    bool virtualClock = false;
+};
+
 // Parse arguments before ncurses is initialized
-void ParseArgsEarly(int argc, char* argv[], ColorMode* pUsrColorMode) {
+void ParseArgsEarly(int argc, char* argv[], EarlyOpts* pOpts) {
     int opt;
     while ((opt = getopt_long(argc, argv, optstring, long_options, nullptr)) != -1) {
-        if (opt != LongOpts::COLORMODE)
-            continue;
+        switch (opt) {
+        case LongOpts::BACKEND: {
+            if (strcasecmp(optarg, "ncurses") == 0) {
+                pOpts->backendType = BackendType::NCURSES;
+            } else if (strcasecmp(optarg, "vt") == 0) {
+                pOpts->backendType = BackendType::VT;
+            } else {
+                Die("--backend must be ncurses or vt\n");
+            }
+            break;
+        }
+        case LongOpts::COLORMODE: {
+            const long int mode = strtol(optarg, nullptr, 10);
+            if (mode == 0) {
+                pOpts->colorMode = ColorMode::MONO;
+            } else if (mode == 16) {
+                pOpts->colorMode = ColorMode::COLOR16;
+            } else if (mode == 24) {
+                pOpts->colorMode = ColorMode::DIRECT;
+            } else if (mode == 32) {
+                pOpts->colorMode = ColorMode::TRUECOLOR;
+            } else if (mode == 256) {
+                pOpts->colorMode = ColorMode::COLOR256;
+            } else {
+                Die("--colormode must be one of 0, 16, 24, 32, or 256\n");
+            }
+            break;
+        }
+        case LongOpts::HEADLESS:
+            pOpts->headless = true;
+            break;
+        case LongOpts::SIZE: {
+            char* nextStr;
+            const long int cols = strtol(optarg, &nextStr, 10);
+            if (!nextStr || (*nextStr != 'x' && *nextStr != 'X'))
+                Die("Invalid --size option (expected WxH)\n");
 
-        const long int mode = strtol(optarg, nullptr, 10);
-        if (mode == 0) {
-            *pUsrColorMode = ColorMode::MONO;
-        } else if (mode == 16) {
-            *pUsrColorMode = ColorMode::COLOR16;
-        } else if (mode == 32) {
-            *pUsrColorMode = ColorMode::TRUECOLOR;
-        } else if (mode == 256) {
-            *pUsrColorMode = ColorMode::COLOR256;
-        } else {
-            Die("--colormode must be one of 0, 16, 32, or 256\n");
+            const long int lines = strtol(nextStr + 1, nullptr, 10);
+            if (cols < 1 || lines < 3 || cols > 0xFFFF || lines > 0xFFFF)
+                Die("--size must be at least 1x3 and at most 65535x65535\n");
+
+            pOpts->cols = static_cast<uint16_t>(cols);
+            pOpts->lines = static_cast<uint16_t>(lines);
+            break;
+        }
+        case LongOpts::TRACE:
+#ifdef ENABLE_TRACE
+            pOpts->tracePath = optarg;
+#else
+            Die("--trace requires neo to be built with ./configure --enable-trace\n");
+#endif
+            break;
+        case LongOpts::VIRTUALCLOCK:
+            pOpts->virtualClock = true;
+            break;
+        default:
+            break;
         }
     }
 }
@@ -505,7 +649,8 @@ vector<wchar_t> ParseUserChars(char* argStr) {
     return output;
 }
 
-void ParseArgs(int argc, char* argv[], Cloud* pCloud, double* targetFPS, bool* profiling) {
+void ParseArgs(int argc, char* argv[], Cloud* pCloud, double* targetFPS, bool* profiling,
+               uint64_t* maxFrames, string* profileJson, bool* perfCounters) {
     optind = 1;
     int opt;
 
@@ -686,6 +831,14 @@ void ParseArgs(int argc, char* argv[], Cloud* pCloud, double* targetFPS, bool* p
         case 'p':
             *profiling = true;
             break;
+        case LongOpts::PROFILEJSON:
+            *profiling = true;
+            *profileJson = optarg;
+            break;
+        case LongOpts::PERFCOUNTERS:
+            *profiling = true;
+            *perfCounters = true;
+            break;
         case 'r': {
             const float pct = atof(optarg);
             if (pct < 0.0f || pct > 100.0f)
@@ -711,6 +864,18 @@ void ParseArgs(int argc, char* argv[], Cloud* pCloud, double* targetFPS, bool* p
             Cleanup();
             PrintVersion();
             break;
+        case LongOpts::ATTRLAYOUT: {
+            if (strcasecmp(optarg, "rows") == 0) {
+                pCloud->SetAttrLayout(Cloud::AttrLayout::ROWS);
+            } else if (strcasecmp(optarg, "cols") == 0) {
+                pCloud->SetAttrLayout(Cloud::AttrLayout::COLS);
+            } else {
+                Die("--attrlayout must be rows or cols\n");
+            }
+            break;
+        }
+        case LongOpts::BACKEND:
+            break; // handled by ParseArgsEarly()
         case LongOpts::CHARS: {
             vector<wchar_t> uniChars = ParseUserChars(optarg);
             const size_t numChars = uniChars.size();
@@ -724,6 +889,27 @@ void ParseArgs(int argc, char* argv[], Cloud* pCloud, double* targetFPS, bool* p
         }
         case LongOpts::COLORMODE:
             break; // handled by ParseArgsEarly()
+        case LongOpts::FRAMES: {
+            const long long frames = strtoll(optarg, nullptr, 10);
+            if (frames < 1)
+                Die("--frames must be greater than 0\n");
+
+            *maxFrames = static_cast<uint64_t>(frames);
+            break;
+        }
+        case LongOpts::GLITCHGROUPS: {
+            const long groups = strtol(optarg, nullptr, 10);
+            if (groups < 1 || groups > 256)
+                Die("--glitchgroups must be between 1 and 256\n");
+
+            pCloud->SetNumGlitchGroups(static_cast<uint16_t>(groups));
+            break;
+        }
+        case LongOpts::HASHATTRS:
+            pCloud->SetHashAttrs(true);
+            break;
+        case LongOpts::HEADLESS:
+            break; // handled by ParseArgsEarly()
         case LongOpts::MAXDPC: {
             const long maxdpc = strtol(optarg, nullptr, 10);
             if (maxdpc < 1 || maxdpc > 3)
@@ -732,11 +918,24 @@ void ParseArgs(int argc, char* argv[], Cloud* pCloud, double* targetFPS, bool* p
             pCloud->SetMaxDropletsPerColumn(static_cast<uint8_t>(maxdpc));
             break;
         }
+        case LongOpts::MESSAGEFILE:
+            pCloud->SetMessage(ReadMessageFile(optarg).c_str());
+            break;
         case LongOpts::NOGLITCH:
             pCloud->SetGlitchy(false);
             pCloud->SetGlitchPct(0.0f);
             pCloud->SetGlitchTimes(0xFFFFU, 0xFFFFU);
             break;
+        case LongOpts::SEED: {
+            char* end = nullptr;
+            errno = 0;
+            const unsigned long long seed = strtoull(optarg, &end, 0);
+            if (errno || end == optarg || *end)
+                Die("--seed must be a non-negative integer\n");
+
+            pCloud->SetSeed(static_cast<uint64_t>(seed));
+            break;
+        }
         case LongOpts::SHORTPCT: {
             const float pct = atof(optarg);
             if (pct < 0.0f || pct > 100.0f)
@@ -745,6 +944,19 @@ void ParseArgs(int argc, char* argv[], Cloud* pCloud, double* targetFPS, bool* p
             pCloud->SetShortPct(pct / 100.0f);
             break;
         }
+        case LongOpts::SIZE:
+            break; // handled by ParseArgsEarly()
+        case LongOpts::THREADS: {
+            const long threads = strtol(optarg, nullptr, 10);
+            if (threads < 1 || threads > 256)
+                Die("--threads must be between 1 and 256\n");
+
+            pCloud->SetNumThreads(static_cast<unsigned>(threads));
+            break;
+        }
+        case LongOpts::TRACE:
+        case LongOpts::VIRTUALCLOCK:
+            break; // handled by ParseArgsEarly()
         case '?':
         default:
             Cleanup();
@@ -759,67 +971,242 @@ void ParseArgs(int argc, char* argv[], Cloud* pCloud, double* targetFPS, bool* p
     }
 }
 
-// This is a rudimentary profiler that keeps track of how long this
-// app takes and how long ncurses refresh() takes.
-void Profiler(Cloud& cloud) {
-    high_resolution_clock::time_point prevTime = high_resolution_clock::now();
-    high_resolution_clock::time_point curTime;
-    high_resolution_clock::time_point curTime2;
-    nanoseconds elapsed;
+volatile sig_atomic_t gotProfileSignal = 0;
 
-    FILE* fp = fopen("time_profile.txt", "w+");
+void OnProfileSignal(int) {
+    gotProfileSignal = 1;
+}
+
+void WriteProfileJson(const Profiler& profiler, const string& jsonPath) {
+    if (jsonPath.empty())
+        return;
+    FILE* fp = fopen(jsonPath.c_str(), "w");
+    if (!fp)
+        return;
+    profiler.WriteJson(fp);
+    fclose(fp);
+}
 
-    while (cloud.Raining()) {
+// Writes the summary to "time_profile.txt" and the JSON to jsonPath (if any),
+// replacing whatever was there. The terminal is in use, so this is how
+// SIGUSR1 reports the results so far.
+void WriteProfile(const Profiler& profiler, const string& jsonPath) {
+    FILE* fp = fopen("time_profile.txt", "w");
+    if (fp) {
+        profiler.PrintSummary(fp);
+        fclose(fp);
+    }
+    WriteProfileJson(profiler, jsonPath);
+}
+
+// Runs frames back to back and records how long each stage of every frame
+// takes. Send SIGUSR1 to write out the percentiles so far. With a virtual
+// clock, each frame simulates one period of targetFPS.
+void ProfileLoop(Cloud& cloud, Backend& backend, double targetFPS, uint64_t maxFrames,
+                 Profiler* pProfiler, const string& jsonPath) {
+    const nanoseconds targetPeriod(static_cast<uint64_t>(round(1.0 / targetFPS * 1.0e9)));
+    uint64_t frames = 0;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = OnProfileSignal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, nullptr);
+
+    cloud.SetProfiler(pProfiler);
+    while (cloud.Raining() && (!maxFrames || frames++ < maxFrames)) {
+        if (cloud.UsesVirtualClock())
+            cloud.AdvanceVirtualClock(targetPeriod);
+        pProfiler->StartFrame();
         HandleInput(&cloud);
+        pProfiler->Mark(Profiler::Stage::INPUT);
         cloud.Rain();
-        curTime2 = high_resolution_clock::now();
-        elapsed = duration_cast<nanoseconds>(curTime2 - prevTime);
-        fprintf(fp, "app_ns=%lld\n", static_cast<long long int>(elapsed.count()));
-        refresh();
-
-        curTime = high_resolution_clock::now();
-        elapsed = duration_cast<nanoseconds>(curTime - curTime2);
-        fprintf(fp, "refresh_ns=%lld\n", static_cast<long long int>(elapsed.count()));
-        prevTime = curTime;
+        if (!backend.Flush(cloud.GetFrameBuffer()))
+            Die("refresh() failed\n");
+        pProfiler->Mark(Profiler::Stage::FLUSH);
+        pProfiler->EndFrame();
+
+        if (gotProfileSignal) {
+            gotProfileSignal = 0;
+            WriteProfile(*pProfiler, jsonPath);
+        }
     }
+    cloud.SetProfiler(nullptr);
+}
 
-    fclose(fp);
+// Sleep until wakeTime, a key is pressed (if pollStdin is true), or the
+// terminal is resized. Only the signals in sigMask are blocked while waiting.
+// Returns true if stdin has data to read.
+bool WaitForInput(high_resolution_clock::time_point wakeTime, const sigset_t* sigMask,
+                  bool pollStdin) {
+    TRACE_SCOPE("wait");
+    struct timespec timeout;
+    struct timespec* pTimeout = nullptr;
+    if (wakeTime != high_resolution_clock::time_point::max()) {
+        const nanoseconds remaining = duration_cast<nanoseconds>(wakeTime - high_resolution_clock::now());
+        if (remaining <= nanoseconds(0))
+            return false;
+        timeout.tv_sec = static_cast<time_t>(remaining.count() / 1000000000);
+        timeout.tv_nsec = static_cast<long>(remaining.count() % 1000000000);
+        pTimeout = &timeout;
+    }
+
+    // EINTR just means that a signal (e.g. SIGWINCH) arrived
+#ifdef HAVE_PPOLL
+    struct pollfd pfd;
+    pfd.fd = STDIN_FILENO;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return ppoll(&pfd, pollStdin ? 1 : 0, pTimeout, sigMask) > 0;
+#else
+    fd_set readFds;
+    FD_ZERO(&readFds);
+    if (pollStdin)
+        FD_SET(STDIN_FILENO, &readFds);
+    return pselect(pollStdin ? STDIN_FILENO + 1 : 0, &readFds, nullptr, nullptr, pTimeout, sigMask) > 0;
+#endif
 }
 
-void MainLoop(Cloud& cloud, double targetFPS) {
+void MainLoop(Cloud& cloud, Backend& backend, double targetFPS, uint64_t maxFrames) {
     const nanoseconds targetPeriod(static_cast<uint64_t>(round(1.0 / targetFPS * 1.0e9)));
-    high_resolution_clock::time_point prevTime = high_resolution_clock::now();
-    high_resolution_clock::time_point curTime;
-    nanoseconds elapsed;
-    nanoseconds prevDelay(5);
-    nanoseconds curDelay;
-    nanoseconds calcDelay;
-
-    while (cloud.Raining()) {
-        HandleInput(&cloud);
+    high_resolution_clock::time_point nextFrameTime = high_resolution_clock::now();
+    uint64_t frames = 0;
+    bool inputReady = false;
+    // Wakeups in a row where stdin was readable but had no key. A few can
+    // happen with partial escape sequences, but at EOF it never stops.
+    unsigned emptyWakeups = 0;
+    const unsigned MAX_EMPTY_WAKEUPS = 8;
+
+    // Keep SIGWINCH blocked except while waiting, so that a resize always
+    // interrupts the wait instead of arriving just before it starts
+    sigset_t origMask;
+    sigset_t waitMask;
+    sigset_t winchMask;
+    sigemptyset(&winchMask);
+    sigaddset(&winchMask, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &winchMask, &origMask);
+    waitMask = origMask;
+    sigdelset(&waitMask, SIGWINCH);
+
+    while (cloud.Raining() && (!maxFrames || frames++ < maxFrames)) {
+        TRACE_SCOPE("frame");
+        if (cloud.UsesVirtualClock())
+            cloud.AdvanceVirtualClock(targetPeriod);
+        const high_resolution_clock::time_point frameStart = high_resolution_clock::now();
+        const bool gotInput = HandleInput(&cloud);
+        if (gotInput)
+            emptyWakeups = 0;
+        else if (inputReady && emptyWakeups < MAX_EMPTY_WAKEUPS)
+            emptyWakeups++;
+        const bool trustInput = emptyWakeups < MAX_EMPTY_WAKEUPS;
         cloud.Rain();
-        if (refresh() != OK)
+        hud.Draw(cloud.GetFrameBuffer(), cloud.GetNumLiveDroplets(), cloud.GetNumDroplets(),
+                 cloud.GetHeadColor());
+        if (!backend.Flush(cloud.GetFrameBuffer()))
             Die("refresh() failed\n");
 
-        curTime = high_resolution_clock::now();
-        elapsed = duration_cast<nanoseconds>(curTime - prevTime);
-        if (elapsed >= targetPeriod) {
-            calcDelay = nanoseconds(0);
-        } else {
-            calcDelay = nanoseconds(targetPeriod - elapsed);
-        }
-        curDelay = (7 * prevDelay + calcDelay) / 8;
-        std::this_thread::sleep_for(curDelay);
-        prevTime = curTime;
-        prevDelay = curDelay;
+        // Frames are scheduled against absolute deadlines so that they do
+        // not drift. If we fall far behind, start again from now rather than
+        // rushing out the missed frames.
+        const high_resolution_clock::time_point curTime = high_resolution_clock::now();
+        hud.RecordFrame(curTime, duration_cast<nanoseconds>(curTime - frameStart),
+                        backend.GetCellsWritten(), backend.GetBytesWritten());
+        nextFrameTime += targetPeriod;
+        if (nextFrameTime + targetPeriod < curTime)
+            nextFrameTime = curTime;
+
+        // Sleep past the next frame if nothing onscreen will change. ncurses
+        // may have buffered more keys, so do not wait long after one. A
+        // virtual clock only moves once per frame, so never skip frames then.
+        high_resolution_clock::time_point wakeTime = nextFrameTime;
+        if (!gotInput && trustInput && !cloud.UsesVirtualClock())
+            wakeTime = max(wakeTime, cloud.NextEventTime());
+        if (hud.IsVisible())
+            wakeTime = min(wakeTime, max(nextFrameTime, hud.NextUpdateTime()));
+        inputReady = WaitForInput(wakeTime, &waitMask, trustInput);
+    }
+
+    sigprocmask(SIG_SETMASK, &origMask, nullptr);
+}
+
+// Run the simulation as fast as possible on a virtual clock that advances by
+// one frame period per frame. Nothing is written to the terminal, but the
+// output is still generated so that its size can be measured.
+// resetNs is how long it took to set up the Cloud. If pProfiler is given,
+// each frame's stages are recorded on it as well.
+void HeadlessLoop(Cloud& cloud, Backend& backend, double targetFPS, uint64_t maxFrames,
+                  nanoseconds resetNs, Profiler* pProfiler) {
+    const nanoseconds targetPeriod(static_cast<uint64_t>(round(1.0 / targetFPS * 1.0e9)));
+    nanoseconds rainTime(0);
+    nanoseconds flushTime(0);
+    uint64_t cellsWritten = 0;
+    uint64_t bytesWritten = 0;
+    // --frames can be huge, so keep a Histogram rather than every frame time
+    Histogram frameNs;
+
+    cloud.SetProfiler(pProfiler);
+    while (cloud.Raining() && frameNs.GetCount() != maxFrames) {
+        TRACE_SCOPE("frame");
+        cloud.AdvanceVirtualClock(targetPeriod);
+        if (pProfiler)
+            pProfiler->StartFrame();
+        const high_resolution_clock::time_point startTime = high_resolution_clock::now();
+        cloud.Rain();
+        const high_resolution_clock::time_point rainDoneTime = high_resolution_clock::now();
+        backend.Flush(cloud.GetFrameBuffer());
+        const high_resolution_clock::time_point flushDoneTime = high_resolution_clock::now();
+        if (pProfiler) {
+            pProfiler->Mark(Profiler::Stage::FLUSH);
+            pProfiler->EndFrame();
+        }
+
+        rainTime += duration_cast<nanoseconds>(rainDoneTime - startTime);
+        flushTime += duration_cast<nanoseconds>(flushDoneTime - rainDoneTime);
+        cellsWritten += backend.GetCellsWritten();
+        bytesWritten += backend.GetBytesWritten();
+        frameNs.Record(duration_cast<nanoseconds>(flushDoneTime - startTime).count());
     }
+    cloud.SetProfiler(nullptr);
+    const uint64_t frames = frameNs.GetCount();
+    if (!frames)
+        return;
+
+    const double totalNs = static_cast<double>((rainTime + flushTime).count());
+    printf("frames:          %llu\n", static_cast<unsigned long long>(frames));
+    printf("size:            %ux%u\n", cloud.GetCols(), cloud.GetLines());
+    printf("frames/sec:      %.1f\n", frames / (totalNs / 1.0e9));
+    printf("ns/frame:        %.0f\n", totalNs / frames);
+    printf("median ns/frame: %llu\n", static_cast<unsigned long long>(frameNs.GetPercentile(50.0)));
+    printf("p99 ns/frame:    %llu\n", static_cast<unsigned long long>(frameNs.GetPercentile(99.0)));
+    printf("max ns/frame:    %llu\n", static_cast<unsigned long long>(frameNs.GetMax()));
+    printf("rain ns/frame:   %.0f\n", static_cast<double>(rainTime.count()) / frames);
+    printf("flush ns/frame:  %.0f\n", static_cast<double>(flushTime.count()) / frames);
+    printf("cells/frame:     %.1f\n", static_cast<double>(cellsWritten) / frames);
+    printf("bytes/frame:     %.1f\n", static_cast<double>(bytesWritten) / frames);
+    printf("reset ns:        %llu\n", static_cast<unsigned long long>(resetNs.count()));
 }
 
+#ifdef ENABLE_TRACE
+// Enough for about 20000 frames
+static constexpr size_t NUM_TRACE_EVENTS = 1 << 18;
+
+void WriteTrace(const char* path) {
+    if (path && !Tracer::Write(path))
+        fprintf(stderr, "Could not write the trace to %s\n", path);
+}
+#endif
+
 int main(int argc, char* argv[]) {
-    ColorMode usrColorMode = ColorMode::INVALID;
+    EarlyOpts earlyOpts;
     ColorMode colorMode = ColorMode::INVALID;
 
-    ParseArgsEarly(argc, argv, &usrColorMode);
+    ParseArgsEarly(argc, argv, &earlyOpts);
+    TRACE_ONLY(if (earlyOpts.tracePath) Tracer::Start(NUM_TRACE_EVENTS));
+    if (earlyOpts.colorMode == ColorMode::DIRECT && !earlyOpts.headless &&
+        earlyOpts.backendType != BackendType::VT) {
+        Die("--colormode=24 requires --backend=vt\n");
+    }
 
     // Determine whether to use UTF-8 or ASCII based on the locale
     bool ascii = true;
@@ -827,22 +1214,64 @@ int main(int argc, char* argv[]) {
     if (loc && strcasestr(loc, "UTF") != nullptr)
         ascii = false;
 
-    if (InitCurses(usrColorMode, &colorMode) == ERR)
+    if (earlyOpts.headless) {
+        colorMode = earlyOpts.colorMode;
+        if (colorMode == ColorMode::INVALID)
+            colorMode = ColorMode::COLOR256;
+    } else if (InitCurses(earlyOpts.colorMode, &colorMode) == ERR) {
         return ERR;
+    }
 
     double targetFPS = 60.0;
     bool profiling = false;
+    uint64_t maxFrames = 0; // 0 means no limit
     Cloud cloud(colorMode, ascii);
-    ParseArgs(argc, argv, &cloud, &targetFPS, &profiling);
+    if (earlyOpts.headless) {
+        cloud.SetScreenSize(earlyOpts.lines, earlyOpts.cols);
+        cloud.UseVirtualClock();
+    } else if (earlyOpts.virtualClock) {
+        cloud.UseVirtualClock();
+    }
+    string profileJson;
+    bool perfCounters = false;
+    ParseArgs(argc, argv, &cloud, &targetFPS, &profiling, &maxFrames, &profileJson, &perfCounters);
+    const high_resolution_clock::time_point resetStart = high_resolution_clock::now();
     cloud.InitChars();
     cloud.Reset();
+    const nanoseconds resetNs = duration_cast<nanoseconds>(high_resolution_clock::now() - resetStart);
+
+    Profiler profiler;
+    if (perfCounters)
+        profiler.EnableCounters();
+    if (earlyOpts.headless) {
+        VtBackend nullBackend(colorMode, -1);
+        HeadlessLoop(cloud, nullBackend, targetFPS, maxFrames ? maxFrames : 1000, resetNs,
+                     profiling ? &profiler : nullptr);
+        if (profiling) {
+            printf("\n");
+            profiler.PrintSummary(stdout);
+            WriteProfileJson(profiler, profileJson);
+        }
+        TRACE_ONLY(WriteTrace(earlyOpts.tracePath));
+        return 0;
+    }
+
+    if (earlyOpts.backendType == BackendType::VT)
+        activeBackend.reset(new VtBackend(colorMode, STDOUT_FILENO));
+    else
+        activeBackend.reset(new NcursesBackend(colorMode));
 
     if (profiling)
-        Profiler(cloud);
+        ProfileLoop(cloud, *activeBackend, targetFPS, maxFrames, &profiler, profileJson);
     else
-        MainLoop(cloud, targetFPS);
+        MainLoop(cloud, *activeBackend, targetFPS, maxFrames);
 
     Cleanup();
+    TRACE_ONLY(WriteTrace(earlyOpts.tracePath));
+    if (profiling) {
+        WriteProfile(profiler, profileJson);
+        profiler.PrintSummary(stdout);
+    }
 
     return 0;
 }
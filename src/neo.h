@@ -66,11 +66,18 @@ enum class Color : unsigned {
     GRAY
 };
 
+enum class BackendType {
+    NCURSES, // ncurses draws everything
+    VT, // neo writes the escape sequences itself
+    INVALID
+};
+
 enum class ColorMode {
     MONO, // no color
     COLOR16, // 16 colors
     COLOR256, // 256 colors
     TRUECOLOR, // 32-bit color
+    DIRECT, // 24-bit RGB sent directly to the terminal (vt backend only)
     INVALID
 };
 
@@ -0,0 +1,156 @@
+/*
+    perfcounters.cpp - Implements the PerfCounters class
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "perfcounters.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+constexpr size_t PerfCounters::NUM_COUNTERS;
+
+const char* PerfCounters::GetCounterName(Counter counter) {
+    switch (counter) {
+        case Counter::CYCLES: return "cycles";
+        case Counter::INSTRUCTIONS: return "instructions";
+        case Counter::CACHE_MISSES: return "cache_misses";
+        case Counter::BRANCH_MISSES: return "branch_misses";
+        default: return "invalid";
+    }
+}
+
+#ifdef HAVE_LINUX_PERF_EVENT_H
+
+static const uint64_t COUNTER_CONFIGS[PerfCounters::NUM_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES,
+    PERF_COUNT_HW_INSTRUCTIONS,
+    PERF_COUNT_HW_CACHE_MISSES,
+    PERF_COUNT_HW_BRANCH_MISSES,
+};
+
+// glibc has no wrapper for perf_event_open()
+static int OpenEvent(uint64_t config, int groupFd) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, groupFd, PERF_FLAG_FD_CLOEXEC));
+}
+
+bool PerfCounters::Open() {
+    Close();
+    int firstErr = 0;
+    for (size_t idx = 0; idx < NUM_COUNTERS; idx++) {
+        const int fd = OpenEvent(COUNTER_CONFIGS[idx], _leaderFd);
+        if (fd < 0) {
+            if (!firstErr)
+                firstErr = errno;
+            continue;
+        }
+        if (_leaderFd < 0)
+            _leaderFd = fd;
+        _fds[idx] = fd;
+        _slot[idx] = static_cast<int>(_numOpen++);
+    }
+    if (_leaderFd >= 0)
+        return true;
+
+    switch (firstErr) {
+        case EACCES:
+        case EPERM:
+            snprintf(_error, sizeof(_error), "not permitted (see /proc/sys/kernel/perf_event_paranoid)");
+            break;
+        case ENOENT:
+        case ENODEV:
+        case EOPNOTSUPP:
+            snprintf(_error, sizeof(_error), "this CPU or VM has no hardware counters");
+            break;
+        case ENOSYS:
+            snprintf(_error, sizeof(_error), "perf_event_open() is not supported by this kernel");
+            break;
+        default:
+            snprintf(_error, sizeof(_error), "perf_event_open() failed: %s", strerror(firstErr));
+            break;
+    }
+    return false;
+}
+
+void PerfCounters::Close() {
+    for (size_t idx = 0; idx < NUM_COUNTERS; idx++) {
+        if (_fds[idx] >= 0)
+            close(_fds[idx]);
+        _fds[idx] = -1;
+        _slot[idx] = -1;
+    }
+    _leaderFd = -1;
+    _numOpen = 0;
+}
+
+bool PerfCounters::Read(uint64_t vals[NUM_COUNTERS]) const {
+    for (size_t idx = 0; idx < NUM_COUNTERS; idx++)
+        vals[idx] = 0;
+    if (_leaderFd < 0)
+        return false;
+
+    // The number of counters, the time enabled and running, then the counts
+    uint64_t buf[3 + NUM_COUNTERS];
+    const ssize_t len = read(_leaderFd, buf, sizeof(buf));
+    if (len < static_cast<ssize_t>((3 + _numOpen) * sizeof(uint64_t)))
+        return false;
+    const uint64_t enabledNs = buf[1];
+    const uint64_t runningNs = buf[2];
+    for (size_t idx = 0; idx < NUM_COUNTERS; idx++) {
+        if (_slot[idx] < 0)
+            continue;
+        uint64_t val = buf[3 + _slot[idx]];
+        if (runningNs && runningNs < enabledNs)
+            val = static_cast<uint64_t>(static_cast<double>(val) * enabledNs / runningNs);
+        vals[idx] = val;
+    }
+    return true;
+}
+
+#else
+
+bool PerfCounters::Open() {
+    snprintf(_error, sizeof(_error), "hardware counters are only supported on Linux");
+    return false;
+}
+
+void PerfCounters::Close() {
+}
+
+bool PerfCounters::Read(uint64_t vals[NUM_COUNTERS]) const {
+    for (size_t idx = 0; idx < NUM_COUNTERS; idx++)
+        vals[idx] = 0;
+    return false;
+}
+
+#endif
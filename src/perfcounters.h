@@ -0,0 +1,73 @@
+/*
+    perfcounters.h
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PERFCOUNTERS_H
+#define PERFCOUNTERS_H
+
+#include <cstddef>
+#include <cstdint>
+
+using namespace std;
+
+// A group of hardware event counters for the calling thread, opened with
+// perf_event_open() on Linux. Only user space is counted, which the default
+// perf_event_paranoid setting allows. Counters that the CPU, the kernel, or
+// a virtual machine does not provide are left out, and Open() only fails if
+// none of them are available. Other systems always fail to open.
+class PerfCounters {
+public:
+    enum class Counter : unsigned {
+        CYCLES,
+        INSTRUCTIONS,
+        CACHE_MISSES,
+        BRANCH_MISSES,
+        INVALID
+    };
+    static constexpr size_t NUM_COUNTERS = static_cast<size_t>(Counter::INVALID);
+    static const char* GetCounterName(Counter counter);
+
+    PerfCounters() = default;
+    ~PerfCounters() { Close(); }
+    PerfCounters(const PerfCounters&) = delete;
+    PerfCounters& operator=(const PerfCounters&) = delete;
+
+    // Starts counting on the calling thread. If this returns false,
+    // GetError() says why.
+    bool Open();
+    void Close();
+    bool IsOpen() const { return _leaderFd >= 0; }
+    bool HasCounter(Counter counter) const { return _slot[static_cast<size_t>(counter)] >= 0; }
+    // Sets vals to the counts since Open(), in Counter order. Missing
+    // counters read 0. If the kernel had to share the hardware with other
+    // counters, the counts are scaled up to estimate the whole time.
+    // Any thread may call this.
+    bool Read(uint64_t vals[NUM_COUNTERS]) const;
+    const char* GetError() const { return _error; }
+
+private:
+    int _leaderFd = -1; // read() on this returns the whole group
+    int _fds[NUM_COUNTERS] = {-1, -1, -1, -1};
+    int _slot[NUM_COUNTERS] = {-1, -1, -1, -1}; // Position in the group, -1 if missing
+    size_t _numOpen = 0;
+    char _error[96] = {};
+};
+
+#endif
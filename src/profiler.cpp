@@ -0,0 +1,253 @@
+/*
+    profiler.cpp - Implements the Histogram and Profiler classes
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "profiler.h"
+
+#include <cmath>
+
+constexpr size_t Histogram::NUM_BUCKETS;
+constexpr size_t Profiler::NUM_STAGES;
+constexpr size_t Profiler::NUM_COUNTERS;
+
+void Histogram::Clear() {
+    for (auto& bucket : _buckets)
+        bucket = 0;
+    _count = 0;
+    _sum = 0;
+    _max = 0;
+}
+
+uint64_t Histogram::GetBucketHighest(size_t bucket) {
+    if (bucket < 2 * SUB_COUNT)
+        return bucket;
+    const int shift = static_cast<int>(bucket / SUB_COUNT) - 1;
+    const uint64_t lowest = (bucket - shift * SUB_COUNT) << shift;
+    return lowest + ((static_cast<uint64_t>(1) << shift) - 1);
+}
+
+uint64_t Histogram::GetPercentile(double pct) const {
+    if (!_count)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(ceil(pct / 100.0 * _count));
+    if (rank < 1)
+        rank = 1;
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < NUM_BUCKETS; bucket++) {
+        seen += _buckets[bucket];
+        if (seen >= rank) {
+            const uint64_t highest = GetBucketHighest(bucket);
+            return highest < _max ? highest : _max;
+        }
+    }
+    return _max;
+}
+
+const char* Profiler::GetStageName(Stage stage) {
+    switch (stage) {
+        case Stage::INPUT: return "input";
+        case Stage::SPAWN: return "spawn";
+        case Stage::ADVANCE: return "advance";
+        case Stage::GLITCH: return "glitch";
+        case Stage::DRAW: return "draw";
+        case Stage::MESSAGE: return "message";
+        case Stage::FLUSH: return "flush";
+        default: return "invalid";
+    }
+}
+
+void Profiler::AttachThread() {
+    if (!_wantCounters)
+        return;
+    unique_lock<mutex> lock(_attachMutex);
+    const thread::id self = this_thread::get_id();
+    for (const thread::id& id : _attached) {
+        if (id == self)
+            return;
+    }
+    _attached.push_back(self);
+
+    unique_ptr<PerfCounters> pCounters(new PerfCounters());
+    if (!pCounters->Open()) {
+        snprintf(_counterError, sizeof(_counterError), "%s", pCounters->GetError());
+        return;
+    }
+    _counters.push_back(std::move(pCounters));
+    _hasCounters = true;
+}
+
+void Profiler::ReadCounters(uint64_t vals[NUM_COUNTERS]) const {
+    for (size_t cIdx = 0; cIdx < NUM_COUNTERS; cIdx++)
+        vals[cIdx] = 0;
+    for (const auto& pCounters : _counters) {
+        uint64_t threadVals[NUM_COUNTERS];
+        pCounters->Read(threadVals);
+        for (size_t cIdx = 0; cIdx < NUM_COUNTERS; cIdx++)
+            vals[cIdx] += threadVals[cIdx];
+    }
+}
+
+void Profiler::MarkCounters(size_t stageIdx) {
+    uint64_t vals[NUM_COUNTERS];
+    ReadCounters(vals);
+    for (size_t cIdx = 0; cIdx < NUM_COUNTERS; cIdx++) {
+        // Scaled counts can dip slightly when the kernel starts sharing a counter
+        if (vals[cIdx] > _lastCounts[cIdx])
+            _stageCounts[stageIdx][cIdx] += vals[cIdx] - _lastCounts[cIdx];
+        _lastCounts[cIdx] = vals[cIdx];
+    }
+}
+
+void Profiler::EndFrame() {
+    for (size_t idx = 0; idx < NUM_STAGES; idx++) {
+        if (_isMarked[idx])
+            _stages[idx].Record(_stageNs[idx]);
+        _stageNs[idx] = 0;
+        _isMarked[idx] = false;
+    }
+    const nanoseconds frameNs = duration_cast<nanoseconds>(high_resolution_clock::now() - _frameStart);
+    _frames.Record(frameNs.count());
+}
+
+static void PrintRow(FILE* fp, const char* name, const Histogram& hist) {
+    fprintf(fp, "%-8s %10llu %10llu %10llu %10llu %10llu\n", name,
+            static_cast<unsigned long long>(hist.GetCount()),
+            static_cast<unsigned long long>(hist.GetPercentile(50.0)),
+            static_cast<unsigned long long>(hist.GetPercentile(90.0)),
+            static_cast<unsigned long long>(hist.GetPercentile(99.0)),
+            static_cast<unsigned long long>(hist.GetMax()));
+}
+
+void Profiler::PrintSummary(FILE* fp) const {
+    fprintf(fp, "%-8s %10s %10s %10s %10s %10s\n", "stage", "count", "p50_ns", "p90_ns", "p99_ns", "max_ns");
+    for (size_t idx = 0; idx < NUM_STAGES; idx++)
+        PrintRow(fp, GetStageName(static_cast<Stage>(idx)), _stages[idx]);
+    PrintRow(fp, "frame", _frames);
+    PrintCounters(fp);
+}
+
+// counts are totals over the given number of frames. Missing counters are "-".
+static void PrintCounterRow(FILE* fp, const char* name, const uint64_t* counts, uint64_t frames,
+                            const PerfCounters& pc) {
+    fprintf(fp, "%-8s", name);
+    for (size_t cIdx = 0; cIdx < PerfCounters::NUM_COUNTERS; cIdx++) {
+        if (pc.HasCounter(static_cast<PerfCounters::Counter>(cIdx)) && frames)
+            fprintf(fp, " %13.0f", static_cast<double>(counts[cIdx]) / frames);
+        else
+            fprintf(fp, " %13s", "-");
+    }
+    const uint64_t cycles = counts[static_cast<size_t>(PerfCounters::Counter::CYCLES)];
+    const uint64_t instrs = counts[static_cast<size_t>(PerfCounters::Counter::INSTRUCTIONS)];
+    if (pc.HasCounter(PerfCounters::Counter::CYCLES) &&
+        pc.HasCounter(PerfCounters::Counter::INSTRUCTIONS) && cycles)
+        fprintf(fp, " %6.2f\n", static_cast<double>(instrs) / cycles);
+    else
+        fprintf(fp, " %6s\n", "-");
+}
+
+void Profiler::PrintCounters(FILE* fp) const {
+    if (!_wantCounters)
+        return;
+    if (!_hasCounters) {
+        fprintf(fp, "\nhardware counters unavailable: %s\n", _counterError);
+        return;
+    }
+    fprintf(fp, "\nmean per frame, user space only, %zu thread(s)\n", _counters.size());
+    fprintf(fp, "%-8s", "stage");
+    for (size_t cIdx = 0; cIdx < NUM_COUNTERS; cIdx++)
+        fprintf(fp, " %13s", PerfCounters::GetCounterName(static_cast<PerfCounters::Counter>(cIdx)));
+    fprintf(fp, " %6s\n", "ipc");
+
+    const PerfCounters& pc = *_counters.front();
+    uint64_t frameCounts[NUM_COUNTERS] = {};
+    for (size_t idx = 0; idx < NUM_STAGES; idx++) {
+        PrintCounterRow(fp, GetStageName(static_cast<Stage>(idx)), _stageCounts[idx],
+                        _stages[idx].GetCount(), pc);
+        for (size_t cIdx = 0; cIdx < NUM_COUNTERS; cIdx++)
+            frameCounts[cIdx] += _stageCounts[idx][cIdx];
+    }
+    PrintCounterRow(fp, "frame", frameCounts, _frames.GetCount(), pc);
+}
+
+static void WriteJsonHistogram(FILE* fp, const char* name, const Histogram& hist, bool isLast) {
+    fprintf(fp, "    \"%s\": {\"count\": %llu, \"mean_ns\": %.1f, \"p50_ns\": %llu, "
+            "\"p90_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu,\n", name,
+            static_cast<unsigned long long>(hist.GetCount()), hist.GetMean(),
+            static_cast<unsigned long long>(hist.GetPercentile(50.0)),
+            static_cast<unsigned long long>(hist.GetPercentile(90.0)),
+            static_cast<unsigned long long>(hist.GetPercentile(99.0)),
+            static_cast<unsigned long long>(hist.GetMax()));
+    // Each bucket is [highest value in the bucket, count]
+    fprintf(fp, "      \"buckets\": [");
+    bool first = true;
+    for (size_t bucket = 0; bucket < Histogram::NUM_BUCKETS; bucket++) {
+        if (!hist.GetBucketCount(bucket))
+            continue;
+        fprintf(fp, "%s[%llu, %llu]", first ? "" : ", ",
+                static_cast<unsigned long long>(Histogram::GetBucketHighest(bucket)),
+                static_cast<unsigned long long>(hist.GetBucketCount(bucket)));
+        first = false;
+    }
+    fprintf(fp, "]}%s\n", isLast ? "" : ",");
+}
+
+void Profiler::WriteJson(FILE* fp) const {
+    fprintf(fp, "{\n  \"stages\": {\n");
+    for (size_t idx = 0; idx < NUM_STAGES; idx++)
+        WriteJsonHistogram(fp, GetStageName(static_cast<Stage>(idx)), _stages[idx], false);
+    WriteJsonHistogram(fp, "frame", _frames, true);
+    fprintf(fp, "  }");
+    WriteJsonCounters(fp);
+    fprintf(fp, "\n}\n");
+}
+
+// Missing counters are null
+static void WriteJsonCounterTotals(FILE* fp, const char* name, const uint64_t* counts,
+                                   uint64_t frames, const PerfCounters& pc, bool isLast) {
+    fprintf(fp, "      \"%s\": {\"frames\": %llu", name, static_cast<unsigned long long>(frames));
+    for (size_t cIdx = 0; cIdx < PerfCounters::NUM_COUNTERS; cIdx++) {
+        const PerfCounters::Counter counter = static_cast<PerfCounters::Counter>(cIdx);
+        if (pc.HasCounter(counter))
+            fprintf(fp, ", \"%s\": %llu", PerfCounters::GetCounterName(counter),
+                    static_cast<unsigned long long>(counts[cIdx]));
+        else
+            fprintf(fp, ", \"%s\": null", PerfCounters::GetCounterName(counter));
+    }
+    fprintf(fp, "}%s\n", isLast ? "" : ",");
+}
+
+// Totals over every frame, rather than the means that PrintSummary() shows
+void Profiler::WriteJsonCounters(FILE* fp) const {
+    if (!_wantCounters)
+        return;
+    if (!_hasCounters) {
+        fprintf(fp, ",\n  \"counters\": {\"error\": \"%s\"}", _counterError);
+        return;
+    }
+    fprintf(fp, ",\n  \"counters\": {\n    \"threads\": %zu,\n    \"stages\": {\n", _counters.size());
+    const PerfCounters& pc = *_counters.front();
+    uint64_t frameCounts[NUM_COUNTERS] = {};
+    for (size_t idx = 0; idx < NUM_STAGES; idx++) {
+        WriteJsonCounterTotals(fp, GetStageName(static_cast<Stage>(idx)), _stageCounts[idx],
+                               _stages[idx].GetCount(), pc, false);
+        for (size_t cIdx = 0; cIdx < NUM_COUNTERS; cIdx++)
+            frameCounts[cIdx] += _stageCounts[idx][cIdx];
+    }
+    WriteJsonCounterTotals(fp, "frame", frameCounts, _frames.GetCount(), pc, true);
+    fprintf(fp, "    }\n  }");
+}
@@ -0,0 +1,157 @@
+/*
+    profiler.h
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "perfcounters.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+// An HDR-style latency histogram. Values are bucketed by their highest set
+// bit and then by the SUB_BITS bits below it, so every bucket is within about
+// 3% of the values in it, all the way from 0 to UINT64_MAX. The buckets are a
+// fixed array, so recording a value never allocates.
+class Histogram {
+public:
+    void Record(uint64_t value) {
+        _buckets[BucketOf(value)]++;
+        _count++;
+        _sum += value;
+        if (value > _max)
+            _max = value;
+    }
+    void Clear();
+    uint64_t GetCount() const { return _count; }
+    uint64_t GetMax() const { return _max; }
+    double GetMean() const { return _count ? static_cast<double>(_sum) / _count : 0.0; }
+    // The highest value that falls in the same bucket as the pct'th
+    // percentile, but no more than GetMax()
+    uint64_t GetPercentile(double pct) const;
+
+    static constexpr int SUB_BITS = 5;
+    static constexpr uint64_t SUB_COUNT = static_cast<uint64_t>(1) << SUB_BITS;
+    static constexpr size_t NUM_BUCKETS = (64 - SUB_BITS + 1) * SUB_COUNT;
+    uint64_t GetBucketCount(size_t bucket) const { return _buckets[bucket]; }
+    static uint64_t GetBucketHighest(size_t bucket);
+
+private:
+    uint64_t _buckets[NUM_BUCKETS] = {};
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+    uint64_t _max = 0;
+
+    static size_t BucketOf(uint64_t value) {
+        if (value < SUB_COUNT)
+            return static_cast<size_t>(value);
+        const int shift = 63 - __builtin_clzll(value) - SUB_BITS;
+        return static_cast<size_t>(shift) * SUB_COUNT + static_cast<size_t>(value >> shift);
+    }
+};
+
+// Splits each frame into stages and keeps a Histogram of how long each stage
+// took. Whoever runs a stage calls Mark() when it is done, and the time since
+// the previous Mark() is charged to that stage. A stage can be marked several
+// times per frame and its times add up. Stages that were never marked during
+// a frame are not recorded for it.
+//
+// With EnableCounters(), every Mark() also reads the hardware counters (see
+// PerfCounters) of every attached thread and adds the change since the last
+// Mark() to that stage's totals. This costs a system call per thread per
+// Mark(), which shows up in the stage times.
+class Profiler {
+public:
+    enum class Stage : unsigned {
+        INPUT,
+        SPAWN,
+        ADVANCE,
+        GLITCH,
+        DRAW,
+        MESSAGE,
+        FLUSH,
+        INVALID
+    };
+    static constexpr size_t NUM_STAGES = static_cast<size_t>(Stage::INVALID);
+    static const char* GetStageName(Stage stage);
+
+    // Call before attaching any threads
+    void EnableCounters() { _wantCounters = true; }
+    // Starts counting hardware events on the calling thread if
+    // EnableCounters() was called. Attach every thread that runs any of the
+    // stages. Safe to call on several threads at once, or twice on one.
+    void AttachThread();
+
+    void StartFrame() {
+        _frameStart = high_resolution_clock::now();
+        _markTime = _frameStart;
+        if (_hasCounters)
+            ReadCounters(_lastCounts);
+    }
+    void Mark(Stage stage) {
+        const high_resolution_clock::time_point now = high_resolution_clock::now();
+        const size_t idx = static_cast<size_t>(stage);
+        _stageNs[idx] += duration_cast<nanoseconds>(now - _markTime).count();
+        _isMarked[idx] = true;
+        _markTime = now;
+        if (_hasCounters)
+            MarkCounters(idx);
+    }
+    void EndFrame(); // Records this frame's stage times
+
+    const Histogram& GetStageHistogram(Stage stage) const { return _stages[static_cast<size_t>(stage)]; }
+    const Histogram& GetFrameHistogram() const { return _frames; }
+    void PrintSummary(FILE* fp) const; // A table of percentiles per stage
+    void WriteJson(FILE* fp) const; // The same, plus every non-empty bucket
+
+private:
+    Histogram _stages[NUM_STAGES];
+    Histogram _frames = {}; // Whole frames, from StartFrame() to EndFrame()
+    uint64_t _stageNs[NUM_STAGES] = {}; // This frame's time so far
+    bool _isMarked[NUM_STAGES] = {};
+    high_resolution_clock::time_point _frameStart = {};
+    high_resolution_clock::time_point _markTime = {};
+
+    static constexpr size_t NUM_COUNTERS = PerfCounters::NUM_COUNTERS;
+    bool _wantCounters = false;
+    bool _hasCounters = false; // At least one thread is attached
+    mutex _attachMutex = {};
+    vector<unique_ptr<PerfCounters>> _counters = {}; // One per attached thread
+    vector<thread::id> _attached = {}; // Threads that were already attached
+    char _counterError[96] = {}; // Why a thread could not be attached
+    uint64_t _lastCounts[NUM_COUNTERS] = {}; // Summed over the threads
+    uint64_t _stageCounts[NUM_STAGES][NUM_COUNTERS] = {}; // Totals over every frame
+
+    void ReadCounters(uint64_t vals[NUM_COUNTERS]) const;
+    void MarkCounters(size_t stageIdx);
+    void PrintCounters(FILE* fp) const;
+    void WriteJsonCounters(FILE* fp) const;
+};
+
+#endif
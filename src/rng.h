@@ -0,0 +1,108 @@
+/*
+    rng.h
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <cstdint>
+
+// A small, fast random number generator (PCG32, see pcg-random.org). Each
+// generator has 64 bits of state plus a stream number. Generators with the
+// same seed but different streams produce independent sequences, so every
+// part of neo can have its own generator without them affecting each other.
+class Rng {
+public:
+    Rng() { Seed(0, 0); }
+
+    void Seed(uint64_t seed, uint64_t stream) {
+        _state = 0;
+        _inc = (stream << 1) | 1;
+        Next();
+        _state += seed;
+        Next();
+    }
+
+    // 32 uniformly random bits
+    uint32_t Next() {
+        const uint64_t oldState = _state;
+        _state = oldState * 6364136223846793005ULL + _inc;
+        const uint32_t xorShifted = static_cast<uint32_t>(((oldState >> 18) ^ oldState) >> 27);
+        const uint32_t rot = static_cast<uint32_t>(oldState >> 59);
+        return (xorShifted >> rot) | (xorShifted << ((32 - rot) & 31));
+    }
+
+    // A uniformly random number in [0, bound). Uses multiplication instead of
+    // the modulo operator (Lemire's method), which is both faster and unbiased.
+    uint32_t Below(uint32_t bound) {
+        if (bound == 0)
+            return 0;
+        uint64_t product = static_cast<uint64_t>(Next()) * bound;
+        uint32_t low = static_cast<uint32_t>(product);
+        if (low < bound) {
+            const uint32_t threshold = (0U - bound) % bound;
+            while (low < threshold) {
+                product = static_cast<uint64_t>(Next()) * bound;
+                low = static_cast<uint32_t>(product);
+            }
+        }
+        return static_cast<uint32_t>(product >> 32);
+    }
+
+    // A uniformly random number in [low, high]
+    uint32_t Range(uint32_t low, uint32_t high) {
+        return low + Below(high - low + 1);
+    }
+
+    // A uniformly random float in [0, 1)
+    float Unit() { return static_cast<float>(Next() >> 8) * (1.0f / 16777216.0f); }
+
+    // Probabilities are compared as integers. ChanceThreshold() converts a
+    // probability from 0.0 to 1.0 into the argument for Chance().
+    static uint64_t ChanceThreshold(float pct) {
+        if (pct <= 0.0f)
+            return 0;
+        if (pct >= 1.0f)
+            return 1ULL << 32;
+        return static_cast<uint64_t>(static_cast<double>(pct) * 4294967296.0);
+    }
+    bool Chance(uint64_t threshold) { return Next() < threshold; }
+
+    // Stateless counterpart to Next(): 32 random-looking bits derived from
+    // key alone (the splitmix64 finalizer). Different seeds and streams give
+    // unrelated results for the same key.
+    static uint32_t Hash(uint64_t key, uint64_t seed, uint64_t stream) {
+        uint64_t z = key ^ (seed * 0x9E3779B97F4A7C15ULL) ^ (stream * 0xD1B54A32D192ED03ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        z ^= z >> 31;
+        return static_cast<uint32_t>(z >> 32);
+    }
+    // Hash() scaled into [low, high]
+    static uint32_t HashRange(uint32_t hash, uint32_t low, uint32_t high) {
+        return low + static_cast<uint32_t>((static_cast<uint64_t>(hash) * (high - low + 1)) >> 32);
+    }
+
+private:
+    uint64_t _state;
+    uint64_t _inc;
+};
+
+#endif
@@ -0,0 +1,165 @@
+/*
+    timingwheel.cpp - Implements the TimingWheel class
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "timingwheel.h"
+
+#include <algorithm>
+#include <limits>
+
+constexpr int64_t TimingWheel::SPAN[];
+
+void TimingWheel::Reset(int64_t nowNs) {
+    for (auto& slot : _level0)
+        slot.clear();
+    for (auto& level : _levels)
+        for (auto& slot : level)
+            slot.clear();
+    _overflow.clear();
+    _numEvents = 0;
+    _curTick = nowNs / NS_PER_TICK;
+}
+
+void TimingWheel::Schedule(uint32_t id, uint32_t gen, int64_t dueNs) {
+    Event event;
+    event.id = id;
+    event.gen = gen;
+    event.dueNs = dueNs;
+    Insert(event);
+    _numEvents++;
+}
+
+// Put an event in the slot that matches its distance from _curTick
+void TimingWheel::Insert(const Event& event) {
+    int64_t tick = event.dueNs / NS_PER_TICK;
+    if (tick < _curTick)
+        tick = _curTick; // Overdue, so collect it on the next PopDue()
+    const int64_t delta = tick - _curTick;
+
+    if (delta < SPAN[0]) {
+        _level0[tick & (LEVEL0_SLOTS - 1)].push_back(event);
+    } else if (delta < SPAN[1]) {
+        _levels[0][(tick >> LEVEL0_BITS) & (LEVEL_SLOTS - 1)].push_back(event);
+    } else if (delta < SPAN[2]) {
+        _levels[1][(tick >> (LEVEL0_BITS + LEVEL_BITS)) & (LEVEL_SLOTS - 1)].push_back(event);
+    } else {
+        _overflow.push_back(event);
+    }
+}
+
+// Re-insert the events of a higher level slot now that they are closer
+void TimingWheel::Cascade(vector<Event>* pSlot) {
+    _scratch.swap(*pSlot);
+    for (const auto& event : _scratch)
+        Insert(event);
+    _scratch.clear();
+}
+
+void TimingWheel::CollectAll(vector<Event>* pEvents) {
+    for (auto& slot : _level0) {
+        pEvents->insert(pEvents->end(), slot.begin(), slot.end());
+        slot.clear();
+    }
+    for (auto& level : _levels) {
+        for (auto& slot : level) {
+            pEvents->insert(pEvents->end(), slot.begin(), slot.end());
+            slot.clear();
+        }
+    }
+    pEvents->insert(pEvents->end(), _overflow.begin(), _overflow.end());
+    _overflow.clear();
+}
+
+int64_t TimingWheel::NextDueNs() const {
+    int64_t dueNs = numeric_limits<int64_t>::max();
+    if (!_numEvents)
+        return dueNs;
+
+    // The first non-empty level 0 slot holds the earliest level 0 events
+    for (int64_t tick = _curTick; tick < _curTick + SPAN[0]; tick++) {
+        const vector<Event>& slot = _level0[tick & (LEVEL0_SLOTS - 1)];
+        if (slot.empty())
+            continue;
+        for (const auto& event : slot)
+            dueNs = min(dueNs, event.dueNs);
+
+        // Events only move down a level when their slot cascades, so the
+        // next slot of each higher level and the overflow list can still
+        // hold events that are closer than this one. The other slots are
+        // at least a whole level 0 span away.
+        for (int level = 1; level < NUM_LEVELS; level++) {
+            const int shift = LEVEL0_BITS + (level - 1) * LEVEL_BITS;
+            const size_t slotIdx = ((_curTick >> shift) + 1) & (LEVEL_SLOTS - 1);
+            for (const auto& event : _levels[level - 1][slotIdx])
+                dueNs = min(dueNs, event.dueNs);
+        }
+        for (const auto& event : _overflow)
+            dueNs = min(dueNs, event.dueNs);
+        return dueNs;
+    }
+
+    // Events in the higher levels are rarer, so just look at all of them
+    for (const auto& level : _levels)
+        for (const auto& slot : level)
+            for (const auto& event : slot)
+                dueNs = min(dueNs, event.dueNs);
+    for (const auto& event : _overflow)
+        dueNs = min(dueNs, event.dueNs);
+    return dueNs;
+}
+
+void TimingWheel::PopDue(int64_t nowNs, vector<Event>* pDue) {
+    const int64_t nowTick = nowNs / NS_PER_TICK;
+    if (nowTick - _curTick >= SPAN[NUM_LEVELS - 1]) {
+        // Stepping through this many ticks would take longer than simply
+        // re-inserting everything (e.g. after the machine was suspended)
+        vector<Event> events;
+        CollectAll(&events);
+        _curTick = nowTick;
+        for (const auto& event : events)
+            Insert(event);
+    }
+
+    for (;;) {
+        // Events that fall in the current tick but are not due yet stay put
+        vector<Event>& slot = _level0[_curTick & (LEVEL0_SLOTS - 1)];
+        size_t kept = 0;
+        for (size_t ii = 0; ii < slot.size(); ii++) {
+            if (slot[ii].dueNs <= nowNs) {
+                pDue->push_back(slot[ii]);
+                _numEvents--;
+            } else {
+                slot[kept++] = slot[ii];
+            }
+        }
+        slot.resize(kept);
+
+        if (_curTick >= nowTick)
+            break;
+
+        _curTick++;
+        if (!(_curTick & (SPAN[0] - 1))) {
+            if (!(_curTick & (SPAN[1] - 1))) {
+                if (!(_curTick & (SPAN[2] - 1)))
+                    Cascade(&_overflow);
+                Cascade(&_levels[1][(_curTick >> (LEVEL0_BITS + LEVEL_BITS)) & (LEVEL_SLOTS - 1)]);
+            }
+            Cascade(&_levels[0][(_curTick >> LEVEL0_BITS) & (LEVEL_SLOTS - 1)]);
+        }
+    }
+}
@@ -0,0 +1,82 @@
+/*
+    timingwheel.h
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef TIMINGWHEEL_H
+#define TIMINGWHEEL_H
+
+#include <cstdint>
+#include <vector>
+
+using namespace std;
+
+// A hierarchical timing wheel. Events are bucketed by their due time in 1ms
+// ticks: the first level covers the next 256 ticks with one slot per tick and
+// each higher level covers 64 times as much as the one below. Events further
+// out than all the levels wait in an overflow list. Adding an event is O(1)
+// and collecting the due events only looks at the slots that time has passed.
+//
+// Events cannot be cancelled. Each event carries a generation number that
+// the owner compares against its own records to skip events that have been
+// superseded.
+class TimingWheel {
+public:
+    struct Event {
+        uint32_t id;
+        uint32_t gen;
+        int64_t dueNs;
+    };
+
+    void Reset(int64_t nowNs); // Drop every event
+    void Schedule(uint32_t id, uint32_t gen, int64_t dueNs);
+    // Move every event with dueNs <= nowNs to the end of *pDue
+    void PopDue(int64_t nowNs, vector<Event>* pDue);
+    bool IsEmpty() const { return _numEvents == 0; }
+    // A time at or before the earliest pending event (INT64_MAX if there are
+    // none). Superseded events are included, so this can be early.
+    int64_t NextDueNs() const;
+
+private:
+    static constexpr int64_t NS_PER_TICK = 1000000;
+    static constexpr int LEVEL0_BITS = 8;
+    static constexpr int LEVEL_BITS = 6;
+    static constexpr int NUM_LEVELS = 3;
+    static constexpr size_t LEVEL0_SLOTS = 1 << LEVEL0_BITS;
+    static constexpr size_t LEVEL_SLOTS = 1 << LEVEL_BITS;
+    // How many ticks ahead each level reaches
+    static constexpr int64_t SPAN[NUM_LEVELS] = {
+        1 << LEVEL0_BITS,
+        1 << (LEVEL0_BITS + LEVEL_BITS),
+        1 << (LEVEL0_BITS + 2 * LEVEL_BITS),
+    };
+
+    int64_t _curTick = 0; // The tick of the last PopDue()
+    size_t _numEvents = 0;
+    vector<Event> _level0[LEVEL0_SLOTS];
+    vector<Event> _levels[NUM_LEVELS - 1][LEVEL_SLOTS]; // Levels 1 and up
+    vector<Event> _overflow = {};
+    vector<Event> _scratch = {};
+
+    void Insert(const Event& event);
+    void Cascade(vector<Event>* pSlot);
+    void CollectAll(vector<Event>* pEvents);
+};
+
+#endif
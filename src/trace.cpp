@@ -0,0 +1,118 @@
+/*
+    trace.cpp - Implements the Tracer class
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "trace.h"
+
+#ifdef ENABLE_TRACE
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+
+using namespace std;
+using namespace std::chrono;
+
+struct TraceEvent {
+    const char* name;
+    int64_t tsNs;
+    int64_t value; // The duration of a span or the value of a counter
+    uint32_t tid;
+    char phase; // 'X' for a span, 'C' for a counter
+};
+
+static unique_ptr<TraceEvent[]> pEvents;
+static size_t numEvents = 0;
+static atomic<uint64_t> nextEvent(0);
+static atomic<uint32_t> nextTid(0);
+static int64_t startNs = 0;
+static thread_local uint32_t threadTid = UINT32_MAX;
+
+static uint32_t GetTid() {
+    if (threadTid == UINT32_MAX)
+        threadTid = nextTid.fetch_add(1);
+    return threadTid;
+}
+
+static void Record(char phase, const char* name, int64_t tsNs, int64_t value) {
+    const uint64_t seq = nextEvent.fetch_add(1, memory_order_relaxed);
+    TraceEvent& event = pEvents[seq % numEvents];
+    event.name = name;
+    event.tsNs = tsNs;
+    event.value = value;
+    event.tid = GetTid();
+    event.phase = phase;
+}
+
+void Tracer::Start(size_t num) {
+    pEvents.reset(new TraceEvent[num]);
+    numEvents = num;
+    nextEvent = 0;
+    startNs = NowNs();
+    GetTid(); // The calling thread is thread 0
+}
+
+bool Tracer::IsRecording() {
+    return numEvents != 0;
+}
+
+int64_t Tracer::NowNs() {
+    return duration_cast<nanoseconds>(high_resolution_clock::now().time_since_epoch()).count();
+}
+
+void Tracer::Complete(const char* name, int64_t beginNs, int64_t endNs) {
+    Record('X', name, beginNs, endNs - beginNs);
+}
+
+void Tracer::Counter(const char* name, int64_t value) {
+    Record('C', name, NowNs(), value);
+}
+
+bool Tracer::Write(const char* path) {
+    FILE* fp = fopen(path, "w");
+    if (!fp)
+        return false;
+
+    const uint64_t end = nextEvent.load();
+    const uint64_t begin = end > numEvents ? end - numEvents : 0;
+    fprintf(fp, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    const uint32_t numThreads = nextTid.load();
+    for (uint32_t tid = 0; tid < numThreads; tid++) {
+        fprintf(fp, "{\"ph\": \"M\", \"name\": \"thread_name\", \"pid\": 1, \"tid\": %u, "
+                "\"args\": {\"name\": \"%s %u\"}},\n", tid, tid ? "worker" : "main", tid);
+    }
+    for (uint64_t seq = begin; seq < end; seq++) {
+        const TraceEvent& event = pEvents[seq % numEvents];
+        const double tsUs = (event.tsNs - startNs) / 1000.0;
+        if (event.phase == 'X') {
+            fprintf(fp, "{\"ph\": \"X\", \"name\": \"%s\", \"pid\": 1, \"tid\": %u, "
+                    "\"ts\": %.3f, \"dur\": %.3f},\n", event.name, event.tid, tsUs, event.value / 1000.0);
+        } else {
+            fprintf(fp, "{\"ph\": \"C\", \"name\": \"%s\", \"pid\": 1, \"tid\": %u, "
+                    "\"ts\": %.3f, \"args\": {\"value\": %lld}},\n", event.name, event.tid, tsUs,
+                    static_cast<long long>(event.value));
+        }
+    }
+    // JSON does not allow a trailing comma, so end with one more event
+    fprintf(fp, "{\"ph\": \"M\", \"name\": \"process_name\", \"pid\": 1, \"args\": {\"name\": \"neo\"}}\n");
+    fprintf(fp, "]}\n");
+    return fclose(fp) == 0;
+}
+
+#endif
@@ -0,0 +1,85 @@
+/*
+    trace.h
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <cstddef>
+#include <cstdint>
+
+// Support for --trace, which records what every thread was doing in each
+// frame and writes it out in the Chrome trace event format at exit. The file
+// can be opened in chrome://tracing or Perfetto.
+//
+// This is only compiled in with "./configure --enable-trace". Otherwise the
+// TRACE_ macros expand to nothing, so they cost nothing in a normal build.
+#ifdef ENABLE_TRACE
+
+// Events go into a fixed-size ring that every thread writes to without
+// locking. Once the ring is full, the oldest events are overwritten. Only
+// call Write() once no other thread is recording.
+class Tracer {
+public:
+    static void Start(size_t numEvents);
+    static bool IsRecording();
+    static int64_t NowNs();
+    // A span of time spent in name. name must be a string literal.
+    static void Complete(const char* name, int64_t startNs, int64_t endNs);
+    static void Counter(const char* name, int64_t value);
+    static bool Write(const char* path);
+};
+
+// Records the time from its construction to the end of its scope
+class TraceScope {
+public:
+    explicit TraceScope(const char* name) :
+        _name(name), _startNs(Tracer::IsRecording() ? Tracer::NowNs() : 0) {}
+    ~TraceScope() {
+        if (_startNs)
+            Tracer::Complete(_name, _startNs, Tracer::NowNs());
+    }
+    TraceScope(const TraceScope&) = delete;
+    TraceScope& operator=(const TraceScope&) = delete;
+
+private:
+    const char* _name;
+    int64_t _startNs;
+};
+
+#define TRACE_CONCAT2(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT2(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+#define TRACE_COUNTER(name, value) \
+    do { \
+        if (Tracer::IsRecording()) \
+            Tracer::Counter(name, static_cast<int64_t>(value)); \
+    } while (0)
+#define TRACE_ONLY(code) code
+
+#else
+
+#define TRACE_SCOPE(name)
+#define TRACE_COUNTER(name, value)
+#define TRACE_ONLY(code)
+
+#endif
+
+#endif
@@ -0,0 +1,109 @@
+/*
+    workerpool.cpp - Implements the WorkerPool class
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "workerpool.h"
+
+WorkerPool::WorkerPool(unsigned numThreads) : _nextTask(0) {
+    for (unsigned ii = 1; ii < numThreads; ii++)
+        _threads.push_back(thread(&WorkerPool::WorkerMain, this, ii));
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        unique_lock<mutex> lock(_mutex);
+        _quit = true;
+    }
+    _startCv.notify_all();
+    for (auto& th : _threads)
+        th.join();
+}
+
+void WorkerPool::Run(size_t numTasks, TaskFunc func, void* pCtx) {
+    if (_threads.empty() || numTasks <= 1) {
+        for (size_t task = 0; task < numTasks; task++)
+            func(pCtx, task);
+        return;
+    }
+
+    StartBatch(numTasks, func, pCtx, false);
+    RunTasks();
+    WaitForBatch();
+}
+
+void WorkerPool::RunOnEveryThread(TaskFunc func, void* pCtx) {
+    if (!_threads.empty())
+        StartBatch(0, func, pCtx, true);
+    func(pCtx, 0);
+    if (!_threads.empty())
+        WaitForBatch();
+}
+
+void WorkerPool::StartBatch(size_t numTasks, TaskFunc func, void* pCtx, bool onEveryThread) {
+    {
+        unique_lock<mutex> lock(_mutex);
+        _func = func;
+        _pCtx = pCtx;
+        _numTasks = numTasks;
+        _onEveryThread = onEveryThread;
+        _nextTask.store(0);
+        _numBusy = static_cast<unsigned>(_threads.size());
+        _batch++;
+    }
+    _startCv.notify_all();
+}
+
+void WorkerPool::WaitForBatch() {
+    unique_lock<mutex> lock(_mutex);
+    while (_numBusy)
+        _doneCv.wait(lock);
+}
+
+void WorkerPool::RunTasks() {
+    for (;;) {
+        const size_t task = _nextTask.fetch_add(1);
+        if (task >= _numTasks)
+            break;
+        _func(_pCtx, task);
+    }
+}
+
+void WorkerPool::WorkerMain(unsigned threadIdx) {
+    uint64_t lastBatch = 0;
+    for (;;) {
+        bool onEveryThread;
+        {
+            unique_lock<mutex> lock(_mutex);
+            while (!_quit && _batch == lastBatch)
+                _startCv.wait(lock);
+            if (_quit)
+                return;
+            lastBatch = _batch;
+            onEveryThread = _onEveryThread;
+        }
+
+        if (onEveryThread)
+            _func(_pCtx, threadIdx);
+        else
+            RunTasks();
+
+        unique_lock<mutex> lock(_mutex);
+        if (--_numBusy == 0)
+            _doneCv.notify_one();
+    }
+}
@@ -0,0 +1,78 @@
+/*
+    workerpool.h
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#pragma once
+
+#ifndef WORKERPOOL_H
+#define WORKERPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+// A fixed set of threads that run batches of independent tasks. The calling
+// thread works on the batch too. Threads take the next unclaimed task from a
+// shared counter whenever they finish one, so a thread that draws cheap tasks
+// simply ends up running more of them.
+class WorkerPool {
+public:
+    typedef void (*TaskFunc)(void* pCtx, size_t task);
+
+    explicit WorkerPool(unsigned numThreads); // Includes the calling thread
+    ~WorkerPool();
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    unsigned GetNumThreads() const { return static_cast<unsigned>(_threads.size()) + 1; }
+    // Call func(pCtx, task) for every task in [0, numTasks) and wait for all
+    // of them to finish
+    void Run(size_t numTasks, TaskFunc func, void* pCtx);
+    // Call func(pCtx, threadIdx) exactly once on every thread, where the
+    // calling thread is 0, and wait for all of them to finish
+    void RunOnEveryThread(TaskFunc func, void* pCtx);
+
+private:
+    vector<thread> _threads = {};
+    mutex _mutex = {};
+    condition_variable _startCv = {};
+    condition_variable _doneCv = {};
+    uint64_t _batch = 0; // Incremented for every Run()
+    bool _quit = false;
+    unsigned _numBusy = 0; // Worker threads still in the current batch
+
+    // The current batch
+    TaskFunc _func = nullptr;
+    void* _pCtx = nullptr;
+    size_t _numTasks = 0;
+    bool _onEveryThread = false; // For RunOnEveryThread()
+    atomic<size_t> _nextTask;
+
+    void StartBatch(size_t numTasks, TaskFunc func, void* pCtx, bool onEveryThread);
+    void WaitForBatch();
+    void WorkerMain(unsigned threadIdx);
+    void RunTasks();
+};
+
+#endif
@@ -0,0 +1,106 @@
+/*
+    droplet_test.cpp - Checks the DropletPool class
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "cloud.h"
+#include "droplet.h"
+#include "neo.h"
+
+#include <algorithm>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+
+void Die(const char* fmtStr, ...) {
+    va_list args;
+    va_start(args, fmtStr);
+    vfprintf(stderr, fmtStr, args);
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+namespace {
+
+int numFailed = 0;
+
+void Check(bool cond, const char* what) {
+    if (!cond) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        numFailed++;
+    }
+}
+
+bool WasVisited(const DropletPool& pool, uint32_t idx) {
+    const vector<uint32_t>& visited = pool.GetVisited();
+    return find(visited.begin(), visited.end(), idx) != visited.end();
+}
+
+// A lingering Droplet is only visited when its head stops being bright and
+// when its linger time ends, not at every char boundary in between
+void TestLingerIsOneEvent() {
+    Cloud cloud(ColorMode::MONO, true);
+    cloud.SetScreenSize(25, 1);
+    cloud.UseVirtualClock();
+    cloud.InitChars();
+    cloud.Reset();
+
+    const high_resolution_clock::time_point startTime = high_resolution_clock::time_point(seconds(1));
+    const milliseconds step(1);
+    const milliseconds linger(1000);
+    const uint16_t endLine = 10;
+    DropletPool pool(&cloud);
+    pool.Resize(1, startTime);
+    const uint32_t idx = static_cast<uint32_t>(pool.Spawn(0, endLine, 0, 20, 50.0f, linger, startTime));
+
+    // Run until the head stops
+    high_resolution_clock::time_point curTime = startTime;
+    const vector<uint32_t> none;
+    while (pool.GetHeadPutLine(idx) != endLine && curTime < startTime + seconds(10)) {
+        curTime += step;
+        pool.Advance(curTime, false, none);
+    }
+    Check(pool.GetHeadPutLine(idx) == endLine, "head reaches its end line");
+    const high_resolution_clock::time_point stopTime = curTime;
+    const uint16_t tailLine = pool.GetTailPutLine(idx);
+
+    // 50 chars per second would be 50 visits, but only the bright head ends
+    int visits = 0;
+    while (curTime + step < stopTime + linger) {
+        curTime += step;
+        pool.Advance(curTime, false, none);
+        if (WasVisited(pool, idx))
+            visits++;
+    }
+    Check(visits == 1, "lingering droplet is only visited when its head dims");
+    Check(pool.GetTailPutLine(idx) == tailLine, "tail waits while lingering");
+
+    // The linger time ending is an event of its own, and the tail follows
+    curTime = stopTime + linger;
+    pool.Advance(curTime, false, none);
+    Check(WasVisited(pool, idx), "droplet is visited when its linger ends");
+    curTime += milliseconds(100);
+    pool.Advance(curTime, false, none);
+    Check(!pool.IsAlive(idx) || pool.GetTailPutLine(idx) != tailLine, "tail moves after lingering");
+}
+
+} // namespace
+
+int main() {
+    TestLingerIsOneEvent();
+    return numFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+/*
+    timingwheel_test.cpp - Checks the TimingWheel class
+
+    Copyright (C) 2021 Stewart Reive
+
+    neo is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    neo is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with neo. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "timingwheel.h"
+
+#include <cstdio>
+#include <cstdlib>
+
+namespace {
+
+constexpr int64_t NS_PER_MS = 1000000;
+int numFailed = 0;
+
+void Check(bool cond, const char* what) {
+    if (!cond) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        numFailed++;
+    }
+}
+
+// An event that is still in level 1 but closer than every level 0 event
+void TestNextDueLevel1BeforeLevel0() {
+    TimingWheel wheel;
+    wheel.Reset(0);
+    wheel.Schedule(0, 0, 270 * NS_PER_MS); // 270 ticks out, so level 1
+
+    vector<TimingWheel::Event> due;
+    wheel.PopDue(100 * NS_PER_MS, &due);
+    Check(due.empty(), "nothing is due at 100ms");
+
+    wheel.Schedule(1, 0, 300 * NS_PER_MS); // 200 ticks out, so level 0
+    Check(wheel.NextDueNs() <= 270 * NS_PER_MS, "level 1 event counts in NextDueNs");
+
+    wheel.PopDue(270 * NS_PER_MS, &due);
+    Check(due.size() == 1 && due[0].id == 0, "level 1 event pops at 270ms");
+    Check(wheel.NextDueNs() == 300 * NS_PER_MS, "level 0 event is next");
+}
+
+// Level 2 and overflow events only cascade at their own boundaries
+void TestNextDueHigherLevels() {
+    const int64_t level2Ms = 1 << 14;
+    TimingWheel wheel;
+    wheel.Reset(0);
+    wheel.Schedule(0, 0, (level2Ms + 10) * NS_PER_MS);
+    wheel.Schedule(1, 0, (int64_t(1) << 20) * NS_PER_MS);
+
+    vector<TimingWheel::Event> due;
+    wheel.PopDue((level2Ms - 20) * NS_PER_MS, &due);
+    wheel.Schedule(2, 0, (level2Ms + 100) * NS_PER_MS);
+    Check(wheel.NextDueNs() <= (level2Ms + 10) * NS_PER_MS, "level 2 event counts in NextDueNs");
+}
+
+void TestEmpty() {
+    TimingWheel wheel;
+    wheel.Reset(0);
+    Check(wheel.IsEmpty(), "wheel starts empty");
+    Check(wheel.NextDueNs() == INT64_MAX, "empty wheel has no next event");
+}
+
+} // namespace
+
+int main() {
+    TestEmpty();
+    TestNextDueLevel1BeforeLevel0();
+    TestNextDueHigherLevels();
+    return numFailed ? EXIT_FAILURE : EXIT_SUCCESS;
+}